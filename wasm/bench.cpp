@@ -0,0 +1,301 @@
+// dtnsim-bench: micro-benchmarks of the phases of dtnsim_step (and of the graph build
+// in dtnsim_init) over agent counts and densities. Links a DTNSIM_PROFILE build of
+// bindings.cpp and reads the per-phase timings of StepProfile after every step, so
+// each phase is measured inside a real step with realistic state. Results go out as
+// JSON (one record per phase and configuration) for comparing optimizations.
+
+#include "dtnsim_api.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options {
+    std::vector<uint32_t> agents = { 1000, 10000, 100000 };
+    std::vector<double> densities = { 1.0, 8.0 };
+    std::vector<std::string> routings = { "carryonly", "epidemic" };
+    uint32_t warmup = 10;
+    uint32_t steps = 30;
+    double dt = 0.016;
+    uint32_t seed = 1;
+    uint32_t threads = 1;
+    double traffic = 0.0;
+    const char* out_path = nullptr;
+    bool perf_counters = false;
+};
+
+// Timings of one phase over the measured steps, in nanoseconds
+struct Samples {
+    std::vector<double> ns;
+    // Work counters of the phase (pair tests, transfers, ...), summed over the steps
+    const char* work_names[2] = { nullptr, nullptr };
+    double work[2] = { 0.0, 0.0 };
+    // Hardware counters of the phase, summed over the steps (see --perf-counters)
+    PhaseCounters counters = {};
+    bool has_counters = false; // a step phase (the graph build is not counted)
+
+    void add_counters(const PhaseCounters& c) {
+        has_counters = true;
+        counters.cycles += c.cycles;
+        counters.instructions += c.instructions;
+        counters.llc_misses += c.llc_misses;
+        counters.branch_misses += c.branch_misses;
+    }
+
+    Samples() = default;
+    Samples(const char* work0, const char* work1) : work_names{ work0, work1 } {}
+    void add(double ms) { ns.push_back(ms * 1e6); }
+};
+
+void usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --agents LIST     agent counts (default 1000,10000,100000; up to 1000000)\n"
+        "  --density LIST    mean number of agents within range of an agent (default 1,8)\n"
+        "  --routing LIST    routing modes (default carryonly,epidemic)\n"
+        "  --warmup N        steps run before measuring (default 10)\n"
+        "  --steps N         measured steps (default 30)\n"
+        "  --dt S            simulation seconds per step (default 0.016)\n"
+        "  --seed N          dtnsim_set_seed (default 1)\n"
+        "  --threads N       routing threads (needs a DTNSIM_THREADS build)\n"
+        "  --traffic RATE    Poisson messages per agent per second (default 0)\n"
+        "  --out PATH        write the JSON there instead of stdout\n"
+        "  --perf-counters   add cycles, instructions, LLC and branch misses per phase\n"
+        "                    (Linux perf_event_open; left out where not permitted)\n",
+        argv0);
+}
+
+template <typename T, typename Parse>
+bool parse_list(const char* s, std::vector<T>& out, Parse parse) {
+    out.clear();
+    std::string item;
+    for (const char* p = s;; ++p) {
+        if (*p == ',' || *p == '\0') {
+            if (item.empty()) return false;
+            out.push_back(parse(item));
+            item.clear();
+            if (*p == '\0') break;
+        } else {
+            item += *p;
+        }
+    }
+    return !out.empty();
+}
+
+bool parse(int argc, char** argv, Options& o) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (std::strcmp(arg, "--perf-counters") == 0) {
+            o.perf_counters = true;
+            continue;
+        }
+        const char* val = (i + 1 < argc) ? argv[++i] : nullptr;
+        if (!val) {
+            std::fprintf(stderr, "%s needs a value\n", arg);
+            return false;
+        }
+        bool ok = true;
+        if (std::strcmp(arg, "--agents") == 0) {
+            ok = parse_list(val, o.agents, [](const std::string& s) {
+                return static_cast<uint32_t>(std::strtoul(s.c_str(), nullptr, 10));
+            });
+        } else if (std::strcmp(arg, "--density") == 0) {
+            ok = parse_list(val, o.densities, [](const std::string& s) { return std::strtod(s.c_str(), nullptr); });
+        } else if (std::strcmp(arg, "--routing") == 0) {
+            ok = parse_list(val, o.routings, [](const std::string& s) { return s; });
+        } else if (std::strcmp(arg, "--warmup") == 0) {
+            o.warmup = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--steps") == 0) {
+            o.steps = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--dt") == 0) {
+            o.dt = std::strtod(val, nullptr);
+        } else if (std::strcmp(arg, "--seed") == 0) {
+            o.seed = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--threads") == 0) {
+            o.threads = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--traffic") == 0) {
+            o.traffic = std::strtod(val, nullptr);
+        } else if (std::strcmp(arg, "--out") == 0) {
+            o.out_path = val;
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", arg);
+            return false;
+        }
+        if (!ok) {
+            std::fprintf(stderr, "bad list for %s\n", arg);
+            return false;
+        }
+    }
+    for (double d : o.densities) {
+        if (d <= 0.0) {
+            std::fprintf(stderr, "densities must be positive\n");
+            return false;
+        }
+    }
+    if (o.steps == 0 || o.dt <= 0.0) {
+        std::fprintf(stderr, "--steps and --dt must be positive\n");
+        return false;
+    }
+    return true;
+}
+
+// World side giving `density` agents in range of an agent on average (agents are
+// spread about uniformly, so that is count * range volume / world volume)
+double world_size_for(uint32_t agents, double density) {
+    const double range = 80.0; // COMM_RANGE in bindings.cpp
+    const double range_volume = 4.0 / 3.0 * 3.14159265358979323846 * range * range * range;
+    return std::cbrt(agents * range_volume / density);
+}
+
+class JsonWriter {
+public:
+    // perf_counters: DTNSIM_PERF_* bits of the counters to report
+    JsonWriter(FILE* f, uint32_t perf_counters) : f_(f), perf_counters_(perf_counters) {}
+
+    void record(const char* name, uint32_t agents, double density, const char* routing,
+                const Samples& s) {
+        std::vector<double> v = s.ns;
+        std::sort(v.begin(), v.end());
+        double sum = 0.0;
+        for (double x : v) sum += x;
+        const double mean = sum / v.size();
+        const double median = v.size() % 2 ? v[v.size() / 2] : 0.5 * (v[v.size() / 2 - 1] + v[v.size() / 2]);
+        std::fprintf(f_, "%s\n    {\"name\": \"%s\", \"agents\": %u, \"density\": %g, ", first_ ? "" : ",",
+                     name, agents, density);
+        if (routing) {
+            std::fprintf(f_, "\"routing\": \"%s\", ", routing);
+        }
+        std::fprintf(f_, "\"iterations\": %zu, \"mean_ns\": %.0f, \"median_ns\": %.0f, \"min_ns\": %.0f, "
+                         "\"max_ns\": %.0f, \"median_ns_per_agent\": %.3f",
+                     v.size(), mean, median, v.front(), v.back(), median / agents);
+        for (int w = 0; w < 2; ++w) {
+            if (s.work_names[w]) {
+                std::fprintf(f_, ", \"%s_per_iteration\": %.1f", s.work_names[w], s.work[w] / v.size());
+            }
+        }
+        const double n = static_cast<double>(v.size());
+        const PhaseCounters& c = s.counters;
+        const uint32_t mask = s.has_counters ? perf_counters_ : 0;
+        if (mask & DTNSIM_PERF_CYCLES) std::fprintf(f_, ", \"cycles_per_iteration\": %.0f", c.cycles / n);
+        if (mask & DTNSIM_PERF_INSTRUCTIONS) {
+            std::fprintf(f_, ", \"instructions_per_iteration\": %.0f", c.instructions / n);
+        }
+        if ((mask & DTNSIM_PERF_CYCLES) && (mask & DTNSIM_PERF_INSTRUCTIONS)) {
+            std::fprintf(f_, ", \"ipc\": %.3f", c.cycles ? static_cast<double>(c.instructions) / c.cycles : 0.0);
+        }
+        if (mask & DTNSIM_PERF_LLC_MISSES) {
+            std::fprintf(f_, ", \"llc_misses_per_iteration\": %.1f", c.llc_misses / n);
+        }
+        if (mask & DTNSIM_PERF_BRANCH_MISSES) {
+            std::fprintf(f_, ", \"branch_misses_per_iteration\": %.1f", c.branch_misses / n);
+        }
+        std::fprintf(f_, "}");
+        first_ = false;
+        std::fprintf(stderr, "%-10s agents=%-8u density=%-5g %-10s median %12.0f ns  (%.1f ns/agent)\n", name,
+                     agents, density, routing ? routing : "", median, median / agents);
+    }
+
+private:
+    FILE* f_;
+    uint32_t perf_counters_;
+    bool first_ = true;
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    Options o;
+    if (!parse(argc, argv, o)) {
+        usage(argv[0]);
+        return 2;
+    }
+    const StepProfile* prof = dtnsim_get_profile();
+    uint32_t perf_counters = 0;
+    if (o.perf_counters) {
+        perf_counters = dtnsim_set_perf_counters(1);
+        if (perf_counters == 0) {
+            std::fprintf(stderr, "hardware counters are not available (perf_event_open failed); "
+                                 "reporting timings only\n");
+        }
+    }
+    FILE* out = o.out_path ? std::fopen(o.out_path, "w") : stdout;
+    if (!out) {
+        std::fprintf(stderr, "cannot open %s\n", o.out_path);
+        return 2;
+    }
+
+    char date[32];
+    const std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    std::fprintf(out, "{\n  \"context\": {\"date\": \"%s\", \"warmup\": %u, \"steps\": %u, \"dt\": %g, "
+                      "\"seed\": %u, \"threads\": %u, \"traffic\": %g, \"perf_counters\": %u},\n  \"benchmarks\": [",
+                 date, o.warmup, o.steps, o.dt, o.seed, o.threads, o.traffic, perf_counters);
+    JsonWriter json(out, perf_counters);
+
+    dtnsim_set_threads(o.threads);
+    dtnsim_set_traffic(o.traffic, 0, 0.0);
+    for (uint32_t agents : o.agents) {
+        for (double density : o.densities) {
+            dtnsim_set_world_size(world_size_for(agents, density));
+            for (size_t r = 0; r < o.routings.size(); ++r) {
+                const char* routing = o.routings[r].c_str();
+                dtnsim_set_seed(o.seed);
+                const auto t0 = std::chrono::steady_clock::now();
+                dtnsim_init(agents, routing);
+                const auto t1 = std::chrono::steady_clock::now();
+                if (r == 0) {
+                    // The graph does not depend on the routing mode: node placement, the
+                    // kNN edge build and agent setup of dtnsim_init, timed once
+                    Samples graph;
+                    graph.add(std::chrono::duration<double, std::milli>(t1 - t0).count());
+                    json.record("knn_graph", agents, density, nullptr, graph);
+                }
+
+                for (uint32_t s = 0; s < o.warmup; ++s) dtnsim_step(o.dt);
+                Samples mobility, grid, cleanup;
+                Samples pairs("cells_visited", "pair_tests");
+                Samples routing_phase("encounters", "transfers");
+                for (uint32_t s = 0; s < o.steps; ++s) {
+                    dtnsim_step(o.dt);
+                    mobility.add(prof->mobility_ms);
+                    mobility.add_counters(prof->phases[1]);
+                    grid.add(prof->grid_ms);
+                    grid.add_counters(prof->phases[2]);
+                    pairs.add(prof->pairs_ms);
+                    pairs.add_counters(prof->phases[3]);
+                    pairs.work[0] += static_cast<double>(prof->cells_visited);
+                    pairs.work[1] += static_cast<double>(prof->pair_tests);
+                    routing_phase.add(prof->routing_ms);
+                    routing_phase.add_counters(prof->phases[4]);
+                    routing_phase.work[0] += static_cast<double>(prof->encounters);
+                    routing_phase.work[1] += static_cast<double>(prof->transfers);
+                    cleanup.add(prof->expiry_ms + prof->delivery_ms);
+                    cleanup.add_counters(prof->phases[5]);
+                    cleanup.add_counters(prof->phases[6]);
+                }
+                json.record("mobility", agents, density, routing, mobility);
+                json.record("grid", agents, density, routing, grid);
+                json.record("pairs", agents, density, routing, pairs);
+                json.record("routing", agents, density, routing, routing_phase);
+                json.record("cleanup", agents, density, routing, cleanup);
+            }
+        }
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) std::fclose(out);
+    return 0;
+}
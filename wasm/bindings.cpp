@@ -5,66 +5,1790 @@
 #include <cstring>
 #include <cstdlib>
 #include <algorithm>
-#include <unordered_map>
-#include <unordered_set>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#ifdef DTNSIM_THREADS
+#include <condition_variable>
+#include <thread>
+#endif
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+#include <intrin.h>
+#endif
+// Both the profiler and allocation tracking count heap allocations
+#if defined(DTNSIM_PROFILE) || defined(DTNSIM_ALLOC_TRACKING)
+#define DTNSIM_COUNT_ALLOCS 1
+#endif
+#if defined(DTNSIM_COUNT_ALLOCS) || defined(DTNSIM_TRACE)
+#include <atomic>
+#include <chrono>
+#endif
+#ifdef DTNSIM_COUNT_ALLOCS
+#include <new>
+#endif
+// Hardware counters for the profiler, where perf_event_open exists
+#if defined(DTNSIM_PROFILE) && defined(__linux__) && !defined(__EMSCRIPTEN__)
+#define DTNSIM_PERF_EVENTS 1
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(DTNSIM_ALLOC_TRACKING) && defined(__EMSCRIPTEN__)
+#include <emscripten/emmalloc.h>
+#endif
+#ifdef DTNSIM_TRACE
+#include <cstdio>
+#endif
+#ifdef DTNSIM_REFERENCE
+#include <cstdarg>
+#include <cstdio>
+#include <set>
+#endif
+
+// Small open-addressed hash map keyed by an unsigned integer (linear probing,
+// power-of-two capacity, backward-shift deletion). Used for per-agent tables that
+// must stay sparse at large agent counts, where std::unordered_map's per-node
+// allocation would dominate memory. The all-ones key is reserved.
+template <typename V, typename K = uint32_t>
+class OpenMap {
+public:
+    static constexpr K EMPTY_KEY = static_cast<K>(~K(0));
+
+    uint32_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+
+    void swap(OpenMap &other) {
+        slots_.swap(other.slots_);
+        std::swap(count_, other.count_);
+    }
+
+    // Remove all entries but keep the slot array, so refilling does not allocate
+    void clear() {
+        for (Slot &s : slots_) s.key = EMPTY_KEY;
+        count_ = 0;
+    }
+
+    // Size the slot array so that n entries fit without growing
+    void reserve(uint32_t n) {
+        size_t capacity = slots_.empty() ? 8 : slots_.size();
+        while (static_cast<size_t>(n) * 4 > capacity * 3) capacity *= 2;
+        if (capacity > slots_.size()) rehash(capacity);
+    }
+
+    V* find(K key) {
+        if (slots_.empty()) return nullptr;
+        const uint32_t mask = static_cast<uint32_t>(slots_.size()) - 1;
+        for (uint32_t i = hash(key) & mask;; i = (i + 1) & mask) {
+            if (slots_[i].key == key) return &slots_[i].value;
+            if (slots_[i].key == EMPTY_KEY) return nullptr;
+        }
+    }
+
+    const V* find(K key) const {
+        return const_cast<OpenMap*>(this)->find(key);
+    }
+
+    // Returns the value for key, inserting `init` first if the key is absent.
+    V& insert(K key, const V& init, bool* inserted = nullptr) {
+        if ((count_ + 1) * 4 > slots_.size() * 3) grow();
+        const uint32_t mask = static_cast<uint32_t>(slots_.size()) - 1;
+        for (uint32_t i = hash(key) & mask;; i = (i + 1) & mask) {
+            if (slots_[i].key == key) {
+                if (inserted) *inserted = false;
+                return slots_[i].value;
+            }
+            if (slots_[i].key == EMPTY_KEY) {
+                slots_[i].key = key;
+                slots_[i].value = init;
+                ++count_;
+                if (inserted) *inserted = true;
+                return slots_[i].value;
+            }
+        }
+    }
+
+    bool erase(K key) {
+        if (slots_.empty()) return false;
+        const uint32_t mask = static_cast<uint32_t>(slots_.size()) - 1;
+        uint32_t i = hash(key) & mask;
+        while (slots_[i].key != key) {
+            if (slots_[i].key == EMPTY_KEY) return false;
+            i = (i + 1) & mask;
+        }
+        // Backward-shift following entries so probe chains stay intact without tombstones
+        for (uint32_t j = (i + 1) & mask; slots_[j].key != EMPTY_KEY; j = (j + 1) & mask) {
+            const uint32_t home = hash(slots_[j].key) & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+        slots_[i].key = EMPTY_KEY;
+        --count_;
+        return true;
+    }
+
+    // Visit every (key, value). The callback must not insert or erase.
+    template <typename F>
+    void for_each(F &&f) {
+        for (Slot &s : slots_) {
+            if (s.key != EMPTY_KEY) f(s.key, s.value);
+        }
+    }
+
+private:
+    struct Slot {
+        K key;
+        V value;
+    };
+
+    static uint32_t hash(uint32_t k) {
+        k ^= k >> 16;
+        k *= 0x7feb352du;
+        k ^= k >> 15;
+        k *= 0x846ca68bu;
+        k ^= k >> 16;
+        return k;
+    }
+
+    static uint32_t hash(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdull;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ull;
+        k ^= k >> 33;
+        return static_cast<uint32_t>(k);
+    }
+
+    void grow() { rehash(slots_.empty() ? 8 : slots_.size() * 2); }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> old;
+        old.swap(slots_);
+        slots_.assign(capacity, Slot{EMPTY_KEY, V()});
+        count_ = 0;
+        for (const Slot &s : old) {
+            if (s.key != EMPTY_KEY) insert(s.key, s.value);
+        }
+    }
+
+    std::vector<Slot> slots_;
+    uint32_t count_ = 0;
+};
+
+// Double-ended priority queue over held message copies, indexed by sequence number.
+// A min-heap yields the transmit order and a mirrored max-heap yields the drop order;
+// both support O(log n) key updates and removals through a per-seq slot index, so a
+// buffer's order is maintained incrementally instead of being re-sorted on each
+// contact. Ties are broken by sequence number (older messages first).
+class MessagePriorityQueue {
+public:
+    uint32_t size() const { return static_cast<uint32_t>(min_heap_.size()); }
+    bool contains(uint32_t seq) const { return slot_of_.find(seq) != nullptr; }
+
+    void clear() {
+        items_.clear();
+        free_.clear();
+        min_heap_.clear();
+        max_heap_.clear();
+        slot_of_.clear();
+    }
+
+    // Make room for n queued copies without allocating
+    void reserve(uint32_t n) {
+        items_.reserve(n);
+        free_.reserve(n);
+        min_heap_.reserve(n);
+        max_heap_.reserve(n);
+        frontier_.reserve(n);
+        slot_of_.reserve(n);
+    }
+
+    // Insert a copy with key, or update the key if its seq is already queued.
+    void push(const Message &m, double key) {
+        if (uint32_t *slot = slot_of_.find(m.seq)) {
+            items_[*slot].msg = m;
+            update_slot(*slot, key);
+            return;
+        }
+        uint32_t slot;
+        if (!free_.empty()) {
+            slot = free_.back();
+            free_.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(items_.size());
+            items_.push_back(Item());
+        }
+        Item &it = items_[slot];
+        it.key = key;
+        it.msg = m;
+        it.min_pos = static_cast<uint32_t>(min_heap_.size());
+        it.max_pos = static_cast<uint32_t>(max_heap_.size());
+        min_heap_.push_back(slot);
+        max_heap_.push_back(slot);
+        slot_of_.insert(m.seq, slot);
+        sift_up(min_heap_, it.min_pos, true);
+        sift_up(max_heap_, it.max_pos, false);
+    }
+
+    void remove(uint32_t seq) {
+        uint32_t *found = slot_of_.find(seq);
+        if (!found) return;
+        const uint32_t slot = *found;
+        slot_of_.erase(seq);
+        erase_at(min_heap_, items_[slot].min_pos, true);
+        erase_at(max_heap_, items_[slot].max_pos, false);
+        free_.push_back(slot);
+    }
+
+    // Highest-priority (smallest key) and lowest-priority (largest key) entries.
+    const Message* best() const {
+        return min_heap_.empty() ? nullptr : &items_[min_heap_[0]].msg;
+    }
+    const Message* worst() const {
+        return max_heap_.empty() ? nullptr : &items_[max_heap_[0]].msg;
+    }
+
+    // Visit queued copies in priority order without disturbing the heap: a small
+    // frontier heap walks the min-heap tree, so visiting the first k entries costs
+    // O(k log k) regardless of queue size. Stop early by returning false.
+    template <typename F>
+    void for_each_ordered(F &&f) {
+        frontier_.clear();
+        if (min_heap_.empty()) return;
+        auto frontier_less = [this](uint32_t x, uint32_t y) {
+            // std heap functions build a max-heap; invert to pop the smallest key first
+            return less(min_heap_[y], min_heap_[x]);
+        };
+        frontier_.push_back(0);
+        while (!frontier_.empty()) {
+            std::pop_heap(frontier_.begin(), frontier_.end(), frontier_less);
+            const uint32_t pos = frontier_.back();
+            frontier_.pop_back();
+            if (!f(items_[min_heap_[pos]].msg)) return;
+            for (uint32_t c = 2 * pos + 1; c <= 2 * pos + 2 && c < min_heap_.size(); ++c) {
+                frontier_.push_back(c);
+                std::push_heap(frontier_.begin(), frontier_.end(), frontier_less);
+            }
+        }
+    }
+
+private:
+    struct Item {
+        double key;
+        Message msg;
+        uint32_t min_pos;
+        uint32_t max_pos;
+    };
+
+    bool less(uint32_t x, uint32_t y) const {
+        const Item &a = items_[x];
+        const Item &b = items_[y];
+        return a.key < b.key || (a.key == b.key && a.msg.seq < b.msg.seq);
+    }
+
+    // For the min-heap, parent must not be greater than child; mirrored for max.
+    bool ordered(uint32_t parent, uint32_t child, bool is_min) const {
+        return is_min ? !less(child, parent) : !less(parent, child);
+    }
+
+    void set_pos(std::vector<uint32_t> &heap, uint32_t pos, bool is_min) {
+        Item &it = items_[heap[pos]];
+        (is_min ? it.min_pos : it.max_pos) = pos;
+    }
+
+    void sift_up(std::vector<uint32_t> &heap, uint32_t pos, bool is_min) {
+        while (pos > 0) {
+            const uint32_t parent = (pos - 1) / 2;
+            if (ordered(heap[parent], heap[pos], is_min)) break;
+            std::swap(heap[parent], heap[pos]);
+            set_pos(heap, pos, is_min);
+            pos = parent;
+        }
+        set_pos(heap, pos, is_min);
+    }
+
+    void sift_down(std::vector<uint32_t> &heap, uint32_t pos, bool is_min) {
+        const uint32_t n = static_cast<uint32_t>(heap.size());
+        for (;;) {
+            uint32_t best = pos;
+            const uint32_t l = 2 * pos + 1;
+            const uint32_t r = l + 1;
+            if (l < n && !ordered(heap[best], heap[l], is_min)) best = l;
+            if (r < n && !ordered(heap[best], heap[r], is_min)) best = r;
+            if (best == pos) break;
+            std::swap(heap[best], heap[pos]);
+            set_pos(heap, pos, is_min);
+            pos = best;
+        }
+        set_pos(heap, pos, is_min);
+    }
+
+    void erase_at(std::vector<uint32_t> &heap, uint32_t pos, bool is_min) {
+        const uint32_t last = static_cast<uint32_t>(heap.size()) - 1;
+        if (pos != last) {
+            const uint32_t moved = heap[last];
+            heap[pos] = moved;
+            heap.pop_back();
+            sift_up(heap, pos, is_min);
+            sift_down(heap, is_min ? items_[moved].min_pos : items_[moved].max_pos, is_min);
+        } else {
+            heap.pop_back();
+        }
+    }
+
+    void update_slot(uint32_t slot, double key) {
+        items_[slot].key = key;
+        sift_up(min_heap_, items_[slot].min_pos, true);
+        sift_down(min_heap_, items_[slot].min_pos, true);
+        sift_up(max_heap_, items_[slot].max_pos, false);
+        sift_down(max_heap_, items_[slot].max_pos, false);
+    }
+
+    std::vector<Item> items_;
+    std::vector<uint32_t> free_;
+    std::vector<uint32_t> min_heap_;
+    std::vector<uint32_t> max_heap_;
+    std::vector<uint32_t> frontier_; // scratch for for_each_ordered
+    OpenMap<uint32_t> slot_of_;
+};
+
+// One agent's message buffer. Copies live in a slot array and are threaded on two
+// intrusive doubly linked lists: arrival order (head = first received) and
+// creation order (head = oldest message; sequence numbers grow with creation
+// time). A dense slot index supports uniform random picks and a seq -> slot map
+// gives O(1) membership. Every drop policy therefore finds and removes its victim
+// in O(1) without scanning or shifting the buffer. Insertion into the creation
+// list walks back from the tail, which is O(1) unless copies arrive out of order.
+class MessageBuffer {
+public:
+    static constexpr uint32_t NIL = 0xFFFFFFFFu;
+
+    uint32_t size() const { return static_cast<uint32_t>(dense_.size()); }
+    bool contains(uint32_t seq) const { return index_.find(seq) != nullptr; }
+
+    const Message* find(uint32_t seq) const {
+        const uint32_t *slot = index_.find(seq);
+        return slot ? &copies_[*slot].msg : nullptr;
+    }
+
+    void clear() {
+        copies_.clear();
+        free_.clear();
+        dense_.clear();
+        index_.clear();
+        arrive_head_ = arrive_tail_ = age_head_ = age_tail_ = NIL;
+    }
+
+    // Make room for n held copies without allocating
+    void reserve(uint32_t n) {
+        copies_.reserve(n);
+        free_.reserve(n);
+        dense_.reserve(n);
+        index_.reserve(n);
+    }
+
+    // Append a copy. The caller guarantees the buffer does not already hold m.seq.
+    // arrival_step is the step index the copy was received in (0 for new messages).
+    void insert(const Message &m, uint32_t arrival_step) {
+        uint32_t slot;
+        if (!free_.empty()) {
+            slot = free_.back();
+            free_.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(copies_.size());
+            copies_.push_back(Copy());
+        }
+        Copy &c = copies_[slot];
+        c.msg = m;
+        c.arrival_step = arrival_step;
+
+        c.arrive_prev = arrive_tail_;
+        c.arrive_next = NIL;
+        if (arrive_tail_ != NIL) copies_[arrive_tail_].arrive_next = slot; else arrive_head_ = slot;
+        arrive_tail_ = slot;
+
+        uint32_t after = age_tail_;
+        while (after != NIL && copies_[after].msg.seq > m.seq) after = copies_[after].age_prev;
+        c.age_prev = after;
+        c.age_next = (after != NIL) ? copies_[after].age_next : age_head_;
+        if (after != NIL) copies_[after].age_next = slot; else age_head_ = slot;
+        if (c.age_next != NIL) copies_[c.age_next].age_prev = slot; else age_tail_ = slot;
+
+        c.dense_pos = static_cast<uint32_t>(dense_.size());
+        dense_.push_back(slot);
+        index_.insert(m.seq, slot);
+    }
+
+    bool remove(uint32_t seq) {
+        const uint32_t *found = index_.find(seq);
+        if (!found) return false;
+        const uint32_t slot = *found;
+        index_.erase(seq);
+        Copy &c = copies_[slot];
+
+        if (c.arrive_prev != NIL) copies_[c.arrive_prev].arrive_next = c.arrive_next; else arrive_head_ = c.arrive_next;
+        if (c.arrive_next != NIL) copies_[c.arrive_next].arrive_prev = c.arrive_prev; else arrive_tail_ = c.arrive_prev;
+        if (c.age_prev != NIL) copies_[c.age_prev].age_next = c.age_next; else age_head_ = c.age_next;
+        if (c.age_next != NIL) copies_[c.age_next].age_prev = c.age_prev; else age_tail_ = c.age_prev;
+
+        const uint32_t moved = dense_.back();
+        dense_[c.dense_pos] = moved;
+        copies_[moved].dense_pos = c.dense_pos;
+        dense_.pop_back();
+
+        free_.push_back(slot);
+        return true;
+    }
+
+    uint32_t arrival_step(uint32_t seq) const { return copies_[*index_.find(seq)].arrival_step; }
+
+    // Drop-policy candidates (nullptr when empty)
+    const Message* first_arrived() const { return arrive_head_ != NIL ? &copies_[arrive_head_].msg : nullptr; }
+    const Message* oldest_created() const { return age_head_ != NIL ? &copies_[age_head_].msg : nullptr; }
+    const Message* youngest_created() const { return age_tail_ != NIL ? &copies_[age_tail_].msg : nullptr; }
+    const Message* at(uint32_t i) const { return i < dense_.size() ? &copies_[dense_[i]].msg : nullptr; }
+
+    // Visit held copies in arrival order. The callback must not modify this buffer.
+    template <typename F>
+    void for_each(F &&f) const {
+        for (uint32_t s = arrive_head_; s != NIL; s = copies_[s].arrive_next) f(copies_[s].msg);
+    }
+
+    // As for_each, but stops as soon as the callback returns false.
+    template <typename F>
+    void for_each_while(F &&f) const {
+        for (uint32_t s = arrive_head_; s != NIL; s = copies_[s].arrive_next) {
+            if (!f(copies_[s].msg)) return;
+        }
+    }
+
+private:
+    struct Copy {
+        Message msg;
+        uint32_t arrive_prev, arrive_next; // arrival order links
+        uint32_t age_prev, age_next;       // creation order links
+        uint32_t dense_pos;                // index into dense_
+        uint32_t arrival_step;             // step index the copy was received in
+    };
+
+    std::vector<Copy> copies_;
+    std::vector<uint32_t> free_;
+    std::vector<uint32_t> dense_;
+    OpenMap<uint32_t> index_; // seq -> slot
+    uint32_t arrive_head_ = NIL, arrive_tail_ = NIL;
+    uint32_t age_head_ = NIL, age_tail_ = NIL;
+};
+
+// Index of the lowest set bit of a non-zero word: a single instruction where the
+// compiler exposes one, a shift loop otherwise
+inline uint32_t ctz64(uint64_t m) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<uint32_t>(__builtin_ctzll(m));
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    unsigned long n;
+    _BitScanForward64(&n, m);
+    return static_cast<uint32_t>(n);
+#else
+    uint32_t n = 0;
+    while (!(m & 1)) { m >>= 1; ++n; }
+    return n;
+#endif
+}
+
+// Summary vector of the sequence numbers held in one buffer: a blocked counting
+// Bloom filter. Counters support removal; the bit array mirrors counter != 0 and
+// is what peers probe. All probes of an entry fall into one 64-bit word, so a
+// lookup is a single word test. Lookups never miss a held message, so "absent" is
+// exact and only "maybe present" needs checking against the buffer. The owner
+// rebuilds the filter at a larger size once it holds more than one entry per
+// 8 bits, which keeps false positives around 3-4%.
+class SummaryVector {
+public:
+    static constexpr uint32_t PROBES = 3;
+    static constexpr uint32_t MIN_WORDS = 8;
+
+    uint32_t size() const { return count_; }
+    bool full() const { return static_cast<uint64_t>(count_) * 8 >= counters_.size(); }
+
+    // Empty the filter, sized for `expected` entries
+    void reset(uint32_t expected) {
+        uint32_t words = MIN_WORDS;
+        while (static_cast<uint64_t>(words) * 64 < static_cast<uint64_t>(expected) * 16) words <<= 1;
+        counters_.assign(static_cast<size_t>(words) * 64, 0);
+        bits_.assign(words, 0);
+        count_ = 0;
+    }
+
+    void clear() {
+        counters_.clear();
+        bits_.clear();
+        count_ = 0;
+    }
+
+    void add(uint32_t seq) {
+        uint32_t word;
+        uint64_t mask;
+        locate(seq, word, mask);
+        for (uint64_t m = mask; m; m &= m - 1) {
+            uint8_t &c = counters_[word * 64 + ctz64(m)];
+            if (c != UINT8_MAX) ++c; // saturated counters stay set for good
+        }
+        bits_[word] |= mask;
+        ++count_;
+    }
+
+    // Remove an entry previously added
+    void remove(uint32_t seq) {
+        uint32_t word;
+        uint64_t mask;
+        locate(seq, word, mask);
+        for (uint64_t m = mask; m; m &= m - 1) {
+            const uint32_t bit = ctz64(m);
+            uint8_t &c = counters_[word * 64 + bit];
+            if (c == UINT8_MAX) continue;
+            if (--c == 0) bits_[word] &= ~(1ull << bit);
+        }
+        --count_;
+    }
+
+    bool maybe_contains(uint32_t seq) const {
+        if (bits_.empty()) return false; // never built: the owner holds nothing yet
+        uint32_t word;
+        uint64_t mask;
+        locate(seq, word, mask);
+        return (bits_[word] & mask) == mask;
+    }
+
+private:
+    // Word and probe bits of seq, from one 64-bit mix of the sequence number.
+    // Probes may coincide; the filter stays correct, merely less selective.
+    void locate(uint32_t seq, uint32_t &word, uint64_t &mask) const {
+        uint64_t z = seq + 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        word = static_cast<uint32_t>(z) & (static_cast<uint32_t>(bits_.size()) - 1);
+        mask = 0;
+        for (uint32_t i = 0; i < PROBES; ++i) mask |= 1ull << ((z >> (32 + 6 * i)) & 63);
+    }
+
+    std::vector<uint8_t> counters_; // 64 per word of bits_
+    std::vector<uint64_t> bits_;
+    uint32_t count_ = 0;
+};
+
+// Hierarchical timing wheel keyed by integer ticks. Level 0 has 256 one-tick slots
+// and each of the three levels above has 64 slots spanning 64x the level below;
+// timers further out wait in an overflow list. Timers cascade toward level 0 as
+// the wheel turns, so advancing costs O(slots crossed + timers moved or fired)
+// regardless of how many timers are pending. Slot vectors keep their capacity,
+// so a warmed-up wheel schedules and fires without allocating.
+class TimingWheel {
+public:
+    TimingWheel() : slots_(L0_SLOTS + 3 * LN_SLOTS) {}
+
+    uint64_t now() const { return current_; }
+    uint32_t pending() const { return pending_; }
+
+    void clear() {
+        for (std::vector<Timer> &s : slots_) s.clear();
+        overflow_.clear();
+        current_ = 0;
+        pending_ = 0;
+    }
+
+    // Schedule id to fire once the wheel reaches `tick` (past ticks fire on the next advance).
+    void schedule(uint64_t tick, uint32_t id) {
+        place(Timer{ tick > current_ ? tick : current_ + 1, id });
+        ++pending_;
+    }
+
+    // Turn the wheel up to `tick`, calling on_expire(id) for every timer due.
+    template <typename F>
+    void advance(uint64_t tick, F &&on_expire) {
+        while (current_ < tick) {
+            ++current_;
+            if ((current_ & (L0_SLOTS - 1)) == 0) cascade(1);
+            std::vector<Timer> &slot = slots_[current_ & (L0_SLOTS - 1)];
+            if (slot.empty()) continue;
+            fired_.swap(slot);
+            for (const Timer &t : fired_) {
+                --pending_;
+                on_expire(t.id);
+            }
+            fired_.clear();
+        }
+    }
+
+private:
+    static constexpr uint32_t L0_BITS = 8;
+    static constexpr uint32_t LN_BITS = 6;
+    static constexpr uint32_t L0_SLOTS = 1u << L0_BITS;
+    static constexpr uint32_t LN_SLOTS = 1u << LN_BITS;
+
+    struct Timer {
+        uint64_t tick;
+        uint32_t id;
+    };
+
+    static uint32_t shift(uint32_t level) { return L0_BITS + (level - 1) * LN_BITS; }
+
+    std::vector<Timer> &level_slot(uint32_t level, uint64_t tick) {
+        const uint32_t idx = static_cast<uint32_t>(tick >> shift(level)) & (LN_SLOTS - 1);
+        return slots_[L0_SLOTS + (level - 1) * LN_SLOTS + idx];
+    }
+
+    void place(const Timer &t) {
+        const uint64_t delta = t.tick - current_;
+        if (delta < L0_SLOTS) {
+            slots_[t.tick & (L0_SLOTS - 1)].push_back(t);
+            return;
+        }
+        for (uint32_t level = 1; level <= 3; ++level) {
+            if (delta < (uint64_t(1) << (shift(level) + LN_BITS))) {
+                level_slot(level, t.tick).push_back(t);
+                return;
+            }
+        }
+        overflow_.push_back(t);
+    }
+
+    // Re-place the timers of the level's current slot; when that level also wrapped,
+    // cascade the level above first so its timers get redistributed too.
+    void cascade(uint32_t level) {
+        const bool wrapped = ((current_ >> shift(level)) & (LN_SLOTS - 1)) == 0;
+        if (wrapped) {
+            if (level < 3) {
+                cascade(level + 1);
+            } else {
+                moved_.swap(overflow_);
+                for (const Timer &t : moved_) place(t);
+                moved_.clear();
+            }
+        }
+        moved_.swap(level_slot(level, current_));
+        for (const Timer &t : moved_) place(t);
+        moved_.clear();
+    }
+
+    std::vector<std::vector<Timer>> slots_;
+    std::vector<Timer> overflow_;
+    std::vector<Timer> moved_; // scratch for cascades
+    std::vector<Timer> fired_; // scratch for expiring slots
+    uint64_t current_ = 0;
+    uint32_t pending_ = 0;
+};
+
+#ifdef DTNSIM_THREADS
+// Fixed set of worker threads that run one batch of tasks at a time. The calling
+// thread takes task 0 and worker w takes task w; run() returns once every task of
+// the batch has finished.
+class WorkerPool {
+public:
+    ~WorkerPool() { resize(1); }
+
+    uint32_t size() const { return static_cast<uint32_t>(threads_.size()) + 1; }
+
+    // Total number of threads including the caller (at least 1)
+    void resize(uint32_t n) {
+        if (n < 1) n = 1;
+        if (n == size()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+            ++generation_;
+        }
+        wake_.notify_all();
+        for (std::thread &t : threads_) t.join();
+        threads_.clear();
+        quit_ = false;
+        for (uint32_t w = 1; w < n; ++w) {
+            threads_.emplace_back([this, w, gen = generation_] { work(w, gen); });
+        }
+    }
+
+    // Run task(t) for every t in [0, tasks); tasks must not exceed size(). The task
+    // is only borrowed for the call (no type-erased copy, so dispatching does not
+    // allocate).
+    template <typename F>
+    void run(uint32_t tasks, F &task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_fn_ = [](void *ctx, uint32_t w) { (*static_cast<F*>(ctx))(w); };
+            task_ctx_ = &task;
+            tasks_ = tasks;
+            busy_ = tasks - 1;
+            ++generation_;
+        }
+        wake_.notify_all();
+        task(0);
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return busy_ == 0; });
+        task_fn_ = nullptr;
+        task_ctx_ = nullptr;
+    }
+
+private:
+    void work(uint32_t w, uint64_t seen) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            wake_.wait(lock, [&] { return generation_ != seen; });
+            seen = generation_;
+            if (quit_) return;
+            if (w >= tasks_) continue;
+            void (*fn)(void *, uint32_t) = task_fn_;
+            void *ctx = task_ctx_;
+            lock.unlock();
+            fn(ctx, w);
+            lock.lock();
+            if (--busy_ == 0) done_.notify_one();
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_, done_;
+    void (*task_fn_)(void *, uint32_t) = nullptr;
+    void *task_ctx_ = nullptr;
+    uint32_t tasks_ = 0;
+    uint32_t busy_ = 0;
+    uint64_t generation_ = 0;
+    bool quit_ = false;
+};
+#endif
+
+#ifdef DTNSIM_COUNT_ALLOCS
+namespace {
+    // Heap allocations made through operator new (all threads) and bytes requested
+    std::atomic<uint64_t> g_alloc_count{0};
+    std::atomic<uint64_t> g_alloc_bytes{0};
+}
+
+// GCC flags the free() below wherever it inlines these into code paired with
+// the builtin operator new; the pairing is correct since both are replaced here.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(std::size_t n) {
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+    if (void *p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+#ifdef DTNSIM_PROFILE
+namespace {
+// Wall-clock laps between the phases of one step
+class PhaseClock {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void start() { start_ = last_ = Clock::now(); }
+
+    // Milliseconds since the previous lap (or start)
+    double lap() {
+        const Clock::time_point t = Clock::now();
+        const double ms = std::chrono::duration<double, std::milli>(t - last_).count();
+        last_ = t;
+        return ms;
+    }
+
+    double total() const {
+        return std::chrono::duration<double, std::milli>(last_ - start_).count();
+    }
+
+private:
+    Clock::time_point start_, last_;
+};
+
+// Hardware counters read at the same laps as PhaseClock. The events form one
+// perf_event_open group on the opening thread, so a lap is a single read() and all
+// events cover the same instructions. Events that fail to open (not permitted by
+// perf_event_paranoid, not supported by the CPU or a VM) are left out; without any,
+// laps do nothing.
+class PerfGroup {
+public:
+    ~PerfGroup() { close(); }
+
+    // Open what the system allows; returns the DTNSIM_PERF_* bits that opened
+    uint32_t open() {
+        close();
+#ifdef DTNSIM_PERF_EVENTS
+        static const uint64_t configs[EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        for (uint32_t e = 0; e < EVENTS; ++e) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[e];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.disabled = fds_[0] < 0 ? 1 : 0; // the group starts when the leader is enabled
+            const int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, fds_[0], 0));
+            if (fd < 0) continue;
+            if (fds_[0] < 0) fds_[0] = fd; else fds_[count_] = fd;
+            order_[count_++] = e;
+            mask_ |= 1u << e;
+        }
+        if (fds_[0] >= 0) ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, 0);
+#endif
+        return mask_;
+    }
+
+    void close() {
+#ifdef DTNSIM_PERF_EVENTS
+        for (int &fd : fds_) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+#endif
+        count_ = 0;
+        mask_ = 0;
+    }
+
+    uint32_t mask() const { return mask_; }
+
+    void start() {
+        phase_ = 0;
+        read(last_);
+    }
+
+    // Counter growth since the previous lap (or start) into the next phase of `p`
+    void lap(StepProfile &p) {
+        if (!mask_ || phase_ >= 7) return;
+        uint64_t now[EVENTS];
+        if (!read(now)) return;
+        uint64_t *out[EVENTS] = { &p.phases[phase_].cycles, &p.phases[phase_].instructions,
+                                  &p.phases[phase_].llc_misses, &p.phases[phase_].branch_misses };
+        for (uint32_t e = 0; e < EVENTS; ++e) *out[e] = now[e] - last_[e];
+        memcpy(last_, now, sizeof(now));
+        p.perf_counters = mask_;
+        ++phase_;
+    }
+
+private:
+    static constexpr uint32_t EVENTS = 4;
+
+    // Current values by event (events that did not open read 0)
+    bool read(uint64_t out[EVENTS]) {
+        memset(out, 0, sizeof(uint64_t) * EVENTS);
+#ifdef DTNSIM_PERF_EVENTS
+        if (fds_[0] < 0) return false;
+        uint64_t buf[1 + EVENTS]; // PERF_FORMAT_GROUP: count, then values in group order
+        if (::read(fds_[0], buf, sizeof(buf)) < static_cast<ssize_t>(sizeof(uint64_t) * (1 + count_))) return false;
+        for (uint32_t k = 0; k < count_ && k < buf[0]; ++k) out[order_[k]] = buf[1 + k];
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    int fds_[EVENTS] = { -1, -1, -1, -1 }; // [0] is the group leader
+    uint32_t order_[EVENTS] = {};          // event of each group member
+    uint32_t count_ = 0;
+    uint32_t mask_ = 0;
+    uint32_t phase_ = 0;
+    uint64_t last_[EVENTS] = {};
+};
+}
+
+// Profiling hooks used by dtnsim_step; they compile to nothing without DTNSIM_PROFILE
+#define DTNSIM_PROFILE_COUNT(field, n) (g_sim->profile.field += (n))
+#define DTNSIM_PROFILE_LAP(field) (g_sim->profile.field = g_sim->phase_clock.lap(), g_sim->phase_counters.lap(g_sim->profile))
+#else
+#define DTNSIM_PROFILE_COUNT(field, n) ((void)0)
+#define DTNSIM_PROFILE_LAP(field) ((void)0)
+#endif
+
+#ifdef DTNSIM_TRACE
+#ifndef DTNSIM_TRACE_CAPACITY
+#define DTNSIM_TRACE_CAPACITY 65536 // events kept (power of two); older ones are overwritten
+#endif
+static_assert((DTNSIM_TRACE_CAPACITY & (DTNSIM_TRACE_CAPACITY - 1)) == 0, "trace capacity must be a power of two");
+
+namespace {
+// One completed scope. `name` must be a string literal.
+struct TraceEvent {
+    const char *name;
+    uint32_t tid;      // 0 = first thread that traced (normally the caller's), then workers
+    uint64_t start_ns; // since g_trace_epoch
+    uint64_t dur_ns;
+};
+
+// Ring of the most recent events. Writers claim a slot with one atomic increment,
+// so routing threads record without locking; dtnsim_write_trace reads the ring
+// between calls, when no scope is open.
+TraceEvent g_trace_ring[DTNSIM_TRACE_CAPACITY];
+std::atomic<uint64_t> g_trace_head{0};
+std::atomic<uint32_t> g_trace_threads{0};
+const std::chrono::steady_clock::time_point g_trace_epoch = std::chrono::steady_clock::now();
+
+inline uint64_t trace_now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - g_trace_epoch).count());
+}
+
+inline uint32_t trace_tid() {
+    thread_local const uint32_t tid = g_trace_threads.fetch_add(1, std::memory_order_relaxed);
+    return tid;
+}
+
+// Records the time from construction (or the last next()) to destruction as an event
+class TraceScope {
+public:
+    explicit TraceScope(const char *name) : name_(name), start_(trace_now_ns()) {}
+    ~TraceScope() { emit(trace_now_ns()); }
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    // End the current event and start the next phase in the same scope
+    void next(const char *name) {
+        const uint64_t now = trace_now_ns();
+        emit(now);
+        name_ = name;
+        start_ = now;
+    }
+
+private:
+    void emit(uint64_t end) {
+        const uint64_t slot = g_trace_head.fetch_add(1, std::memory_order_relaxed) & (DTNSIM_TRACE_CAPACITY - 1);
+        g_trace_ring[slot] = TraceEvent{ name_, trace_tid(), start_, end - start_ };
+    }
+
+    const char *name_;
+    uint64_t start_;
+};
+}
+
+#define DTNSIM_TRACE_SCOPE(var, name) TraceScope var(name)
+#define DTNSIM_TRACE_NEXT(var, name) (var).next(name)
+#else
+#define DTNSIM_TRACE_SCOPE(var, name) ((void)0)
+#define DTNSIM_TRACE_NEXT(var, name) ((void)0)
+#endif
+
+// MaxProp meeting statistics toward one peer agent.
+struct MaxPropMeeting {
+    uint32_t count;             // number of distinct contacts with the peer
+    uint32_t last_contact_step; // step index of the most recent contact (UINT32_MAX = never)
+};
+
+// Partial transfer over one direction of a contact (seq 0 = nothing in flight)
+struct LinkDirection {
+    uint32_t seq;
+    double bytes_done;
+};
+
+// Per-contact link state carried across the steps a pair stays in range
+struct ContactState {
+    LinkDirection dir[2]; // [0]: a -> b, [1]: b -> a (a_idx < b_idx)
+};
+
+// PRoPHET delivery predictability toward one destination agent. Aging is applied
+// lazily: `p` is the value as of `updated_at`, and readers decay it on access.
+struct ProphetEntry {
+    float p;
+    double updated_at;
+    uint32_t last_contact_step; // step index of the most recent direct contact (UINT32_MAX = never)
+};
+
+// splitmix64 generator for the traffic subsystem (and the mobility of seeded runs).
+// Traffic has its own instance so enabling it does not change the mobility of a run.
+struct SplitMix64 {
+    static constexpr uint64_t GAMMA = 0x9e3779b97f4a7c15ull;
+    uint64_t state = 0;
+
+    uint64_t next() {
+        uint64_t z = (state += GAMMA);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+    // Uniform in [0, 1)
+    double uniform() { return static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0); }
+    // Uniform in [0, n)
+    uint32_t below(uint32_t n) { return static_cast<uint32_t>((static_cast<uint64_t>(next() >> 32) * n) >> 32); }
+};
+
+// A message scheduled by dtnsim_inject_messages for a later simulation time
+struct PendingInjection {
+    MessageInjection rec;
+    uint64_t order; // arrival order of the record, breaks ties between equal times
+};
+
+// Internal C++ graph and agent structures (use C ABI types from header)
+struct GraphNode {
+    float x, y, z;
+    std::vector<uint32_t> neighbors; // indices of neighboring graph nodes
+};
+
+// Static graph of a run. Read-only once built, so seeded simulations with the same
+// graph seed, node count and world size share one copy (see shared_graph).
+struct Graph {
+    std::vector<GraphNode> nodes;
+    std::vector<float> positions; // [x0, y0, z0, ...] node positions for rendering
+};
+
+struct Agent {
+    uint32_t id;
+    uint32_t current_node; // index into graph nodes
+    uint32_t target_node;  // next node to walk toward
+    float progress;        // 0.0 - 1.0 along edge current_node -> target_node
+    float x, y, z;         // current interpolated position in space
+    MessageBuffer buffer;          // messages currently held by this agent
+    SummaryVector summary;         // Bloom summary of `buffer` (maintained only in summary-vector mode)
+    bool has_initial = false;      // has this agent ever received the initial message?
+    OpenMap<ProphetEntry> prophet; // PRoPHET predictabilities keyed by destination agent index
+    OpenMap<MaxPropMeeting> maxprop_meetings; // MaxProp contact counts keyed by peer agent index
+    MessagePriorityQueue maxprop_queue;       // MaxProp transmit/drop order over held messages
+    SplitMix64 drop_rng;                      // victim choice of the "random" drop policy
+    std::vector<uint32_t> immune;             // anti-packets: sorted seqs known delivered (immunity mode)
+};
+
+// --- DTN Simulation State ---
+namespace {
+    // Bookkeeping for one live message, kept aligned with g_sim->messages
+    struct MessageMeta {
+        double created_at;             // simulation time the message was injected [s]
+        uint32_t copies;               // copies currently held by agents
+        // Agents that took a copy. Entries of agents that dropped it since are only
+        // weeded out once they outnumber the live copies.
+        std::vector<uint32_t> holders;
+    };
+
+    // Spatial grid parameters
+    constexpr float COMM_RANGE = 80.0f; // reduced to ~0.4x of previous
+    constexpr float GRID_CELL_SIZE = COMM_RANGE; // cell size == comm range
+    constexpr float AGENT_SPEED = 150.0f; // units per second (spatial speed)
+    constexpr double TTL_TICK = 0.125;    // expiry wheel resolution [s]
+    constexpr uint32_t PARALLEL_MIN_CHUNK = 32; // fewest encounters worth handing to a routing thread
+    constexpr uint32_t ENCOUNTERS_PER_AGENT = 4; // encounter storage reserved per agent (grows past it if needed)
+    // PRoPHET and MaxProp tables hold at most one entry per other agent. Up to this
+    // many agents they are reserved for all of them (about 64 MB of PRoPHET tables
+    // at the limit); larger runs grow them as agents meet new peers.
+    constexpr uint32_t ROUTING_TABLE_RESERVE_AGENTS = 1024;
+
+    struct GridCellKey {
+        int gx, gy, gz;
+        bool operator==(const GridCellKey &o) const { return gx==o.gx && gy==o.gy && gz==o.gz; }
+    };
+
+    // Grid cell packed into one integer key (21 bits per axis, offset so that
+    // small negative coordinates stay distinct)
+    inline uint64_t cell_code(const GridCellKey &k) {
+        constexpr int64_t OFFSET = 1 << 20;
+        constexpr uint64_t MASK = (1u << 21) - 1;
+        return ((static_cast<uint64_t>(k.gx + OFFSET) & MASK) << 42) |
+               ((static_cast<uint64_t>(k.gy + OFFSET) & MASK) << 21) |
+               (static_cast<uint64_t>(k.gz + OFFSET) & MASK);
+    }
+
+    // Agents of one grid cell: [begin, end) of StepScratch::cell_agents
+    struct CellSpan {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    // PRoPHET parameters (Lindgren et al. defaults)
+    constexpr float PROPHET_P_INIT = 0.75f;  // direct encounter reinforcement
+    constexpr float PROPHET_BETA = 0.25f;    // transitivity scaling
+    constexpr float PROPHET_GAMMA = 0.98f;   // aging factor per time unit
+    constexpr double PROPHET_AGING_UNIT = 1.0; // seconds of simulation time per aging step
+    constexpr float PROPHET_P_MIN = 1e-3f;   // entries aged below this are dropped from the table
+
+    // MaxProp: copies with fewer hops than this are prioritized by hop count alone
+    constexpr uint32_t MAXPROP_HOP_THRESHOLD = 3;
+
+    // Encounter pair within one step
+    struct Encounter {
+        uint32_t a_idx;
+        uint32_t b_idx;
+    };
+
+    // PRoPHET: read P(owner -> dst) with aging applied up to `now`. The aged value is
+    // written back so repeated reads do not re-apply the same decay. Entries that
+    // decayed below PROPHET_P_MIN are removed to keep the table sparse.
+    inline float prophet_get(Agent &owner, uint32_t dst_idx, double now) {
+        ProphetEntry *e = owner.prophet.find(dst_idx);
+        if (!e) return 0.0f;
+        if (now > e->updated_at) {
+            const double k = (now - e->updated_at) / PROPHET_AGING_UNIT;
+            e->p *= static_cast<float>(std::pow(static_cast<double>(PROPHET_GAMMA), k));
+            e->updated_at = now;
+            if (e->p < PROPHET_P_MIN) {
+                owner.prophet.erase(dst_idx);
+                return 0.0f;
+            }
+        }
+        return e->p;
+    }
+
+    // PRoPHET: raise P(owner -> dst) by `gain` of the remaining headroom.
+    inline void prophet_reinforce(Agent &owner, uint32_t dst_idx, float gain, double now) {
+        prophet_get(owner, dst_idx, now); // bring the stored value up to date first
+        ProphetEntry &e = owner.prophet.insert(dst_idx, ProphetEntry{0.0f, now, UINT32_MAX});
+        e.p += (1.0f - e.p) * gain;
+        e.updated_at = now;
+    }
+
+    struct ProphetUpdate {
+        uint32_t owner_idx;
+        uint32_t dst_idx;
+        float gain;
+    };
+
+    // A copy stored at or dropped from an agent
+    struct CopyEvent {
+        uint32_t seq;
+        uint32_t agent_idx;
+        bool stored;
+    };
+
+    // A copy queued for a receiver by the bulk-synchronous epidemic mode
+    struct Delivery {
+        uint32_t to_idx;
+        Message msg; // the sender's copy
+    };
+
+    // Routing work updates per-agent state (buffers, tables) in place and records
+    // its effects on shared state here; flush_log applies them. Encounters of one
+    // round touch disjoint agents, so each worker can fill its own log.
+    struct RoutingLog {
+        RoutingStats stats{};                       // counter increments
+        std::vector<CopyEvent> copies;              // holder list changes, in order
+        std::vector<uint32_t> reached;              // messages handed to their destination
+        std::vector<ProphetUpdate> prophet_updates; // scratch for one PRoPHET contact
+        std::vector<Delivery> outbox;               // bulk-synchronous epidemic sends
+        std::vector<uint32_t> immune_merge;         // scratch for one anti-packet exchange
+    };
+
+    // Working storage of dtnsim_step. It is only cleared between steps, never
+    // released, so a step in steady state reuses it without allocating.
+    struct StepScratch {
+        std::vector<uint32_t> cell_agents;  // agent indices grouped by cell, ascending in a cell
+        OpenMap<CellSpan, uint64_t> cells;  // cell_code -> span of cell_agents
+        std::vector<Encounter> encounters;
+        std::vector<ContactState*> contact_of;
+        std::vector<uint32_t> next_round, round_start, enc_round, order, fill;
+        std::vector<Delivery> inbox;
+        std::vector<std::pair<uint32_t, uint32_t>> learned; // anti-packets, see spread_immunity
+        std::vector<uint32_t> fresh; // agents infected in this step, see the single-message path
+    };
+
+#ifdef DTNSIM_REFERENCE
+    // Reference engine of the differential mode: a deliberately plain version of
+    // dtnsim_step (all-pairs encounter search, buffers as arrays in arrival order,
+    // whole-population scans where the optimized engine keeps an index) that runs in
+    // lockstep with it. Messages are not generated by the reference: every message
+    // the optimized engine creates is replayed into it at the start of its next step.
+    struct RefCopy {
+        Message msg;
+        uint32_t arrival_step;
+    };
+    struct RefAgent {
+        uint32_t current_node, target_node;
+        float progress;
+        float x, y, z;
+        bool has_initial;
+        std::vector<RefCopy> buffer; // arrival order
+    };
+    struct RefMessage {
+        Message msg;
+        double created_at;
+    };
+    struct RefCreation {
+        Message msg;
+        double created_at;
+        uint32_t src_idx;
+    };
+    struct ReferenceEngine {
+        bool active = false;
+        std::vector<RefAgent> agents;
+        std::map<uint32_t, RefMessage> messages;  // live messages by seq
+        std::vector<RefCreation> created;         // created by the optimized engine since the last step
+        std::vector<Encounter> encounters;
+        std::vector<uint32_t> reached;            // messages handed to their destination this step
+        RoutingStats stats{};
+        SplitMix64 rng;                           // mobility draws (a copy of g_sim->sim_rng at init)
+        double sim_time = 0.0;
+        uint32_t step_index = 0;
+    };
+#endif
+
+    // A value-initialized record (StepProfile, AllocStats) with its enabled flag set
+    template <class T>
+    T enabled_record() {
+        T r{};
+        r.enabled = 1;
+        return r;
+    }
+}
+
+// --- DTN Simulation State ---
+// One simulation: graph, agents, messages, statistics, settings and the working
+// storage of its steps. The dtnsim_* calls work on a process-wide default instance;
+// dtnsim_create makes independent ones for the dtnsim_ctx_* calls.
+struct DtnSim {
+    std::shared_ptr<const Graph> graph; // static graph nodes (null before dtnsim_init)
+    std::vector<Agent> agents;          // moving agents walking on the graph
+    std::vector<float> agent_positions; // [x0, y0, z0, ...] dynamic agent positions for rendering
+    NodePositionsBuffer node_positions_buf = {0, 0, 0, 12, 1, 0};
+    NodePositionsBuffer agent_positions_buf = {0, 0, 0, 12, 1, 0};
+    uint32_t node_positions_version = 1;
+    uint32_t agent_positions_version = 1;
+
+    std::vector<Message> messages; // global message list (one entry per active message)
+    std::vector<MessageMeta> message_meta; // aligned with messages
+    std::vector<std::vector<uint32_t>> holder_pool; // holder lists of removed messages, for reuse
+    OpenMap<uint32_t> message_pos;         // seq -> index into messages
+    TimingWheel expiry_wheel;              // TTL expirations keyed by TTL_TICK ticks, by seq
+    OpenMap<ContactState, uint64_t> contacts;      // contacts of the current step, keyed by (a_idx << 32 | b_idx)
+    OpenMap<ContactState, uint64_t> contacts_prev; // contacts of the previous step
+    std::vector<uint8_t> agent_delivered; // 0/1 per agent: ever received initial message
+    RoutingStats stats{};
+    DeliveryHistograms delivery_hist{};
+#ifdef DTNSIM_PROFILE
+    StepProfile profile = enabled_record<StepProfile>(); // last step's profile; enabled before the first step
+    PhaseClock phase_clock;
+    PerfGroup phase_counters;
+    uint64_t profile_tx_before = 0;
+    uint64_t profile_allocs_before = 0;
+#else
+    StepProfile profile{}; // stays zero without DTNSIM_PROFILE
+#endif
+#ifdef DTNSIM_ALLOC_TRACKING
+    // Enabled before the first step, so harnesses can check. The counts are process
+    // wide: with several simulations stepping at once they include each other's.
+    AllocStats alloc_stats = enabled_record<AllocStats>();
+    uint64_t alloc_count_before = 0;
+    uint64_t alloc_bytes_before = 0;
+#else
+    AllocStats alloc_stats{}; // stays zero without DTNSIM_ALLOC_TRACKING
+#endif
+    uint32_t node_count = 0;
+    uint32_t agent_count = 0;
+    uint32_t seq_counter = 0;
+    double sim_time = 0.0;     // accumulated simulation time [s]
+    uint32_t step_index = 0;   // number of completed dtnsim_step calls
+    // 0: CarryOnly, 1: Epidemic, 2: PRoPHET, 3: MaxProp, 4: Epidemic (bulk-synchronous),
+    // 5: Epidemic ensemble
+    int routing_mode = 0;
+
+    // Buffer configuration (set via dtnsim_set_buffer_policy; survives dtnsim_reset)
+    uint32_t buffer_capacity = 0; // max copies held per agent (0 = unbounded)
+    // 0: drop-head, 1: drop-oldest, 2: drop-youngest, 3: random
+    int drop_policy = 0;
+    uint32_t default_ttl = 0; // TTL [s] given to newly created messages (0 = no expiry)
+    uint32_t default_message_size = 1024; // size [bytes] given to newly created messages
+    double link_rate = 0.0;   // bytes per second per contact direction (0 = unlimited)
+    bool summary_vectors = false; // prefilter encounter offers with per-agent Bloom summaries
+    bool immunity = false;        // delivered messages are purged by anti-packets, not globally
+    uint32_t thread_count = 1;    // routing threads (used only when built with DTNSIM_THREADS)
+    float world_size = 1500.0f;   // side of the box graph nodes are placed in
+    bool seeded = false;          // draw from sim_rng instead of rand() (set via dtnsim_set_seed)
+    uint32_t seed = 0;            // also mixed into the traffic and drop generators
+    bool graph_seeded = false;    // graph drawn from graph_seed instead of seed
+    uint32_t graph_seed = 0;      // set via dtnsim_set_graph_seed
+    SplitMix64 sim_rng;           // reseeded by every dtnsim_init of a seeded run
+
+    // Traffic generation (set via dtnsim_set_traffic; survives dtnsim_reset)
+    double traffic_rate = 0.0;     // messages per second created by each agent (0 = off)
+    uint32_t hotspot_count = 0;    // agents acting as hotspot destinations
+    double hotspot_fraction = 0.0; // share of generated messages addressed to a hotspot
+    std::vector<uint32_t> hotspots; // hotspot agent indices, drawn on first use
+    SplitMix64 traffic_rng;
+    // Injections waiting for their time, a min-heap on (at_ms, order)
+    std::vector<PendingInjection> pending_injections;
+    uint64_t injection_order = 0;
+    // Messages whose destination received a copy during the current step
+    std::vector<uint32_t> reached_destination;
+
+    RoutingLog log; // for work done outside the routing rounds (message creation)
+    StepScratch scratch;
+#ifdef DTNSIM_THREADS
+    WorkerPool pool;
+#endif
+    std::vector<RoutingLog> worker_logs; // one per routing thread
+    std::vector<uint32_t> copyless;      // messages left without copies, see remove_copyless
+
+    // Epidemic ensemble (routing mode 5)
+    std::vector<uint32_t> ensemble_sources; // set via dtnsim_set_ensemble_sources; survives dtnsim_reset
+    std::vector<uint64_t> ensemble_held;    // replica masks, one per agent
+    std::vector<uint64_t> ensemble_before;  // ensemble_held when the step's routing started
+    EnsembleStats ensemble{};
+
+    // Shared mobility (set via dtnsim_ctx_follow; survives dtnsim_reset)
+    DtnSim *leader = nullptr;        // context whose movement and encounters this one uses
+    std::vector<DtnSim*> followers; // contexts stepped with this one
+#ifdef DTNSIM_REFERENCE
+    bool differential = false; // set via dtnsim_set_differential; survives dtnsim_reset
+    ReferenceEngine ref;
+    std::string divergence;    // first divergence (empty while the engines agree)
+#endif
+};
+
+namespace {
+    // The simulation the API call in progress on this thread works on. Every
+    // dtnsim_ctx_* entry point installs its context for the duration of the call,
+    // and routing threads install the context of the step they work for.
+    thread_local DtnSim *g_sim = nullptr;
+    DtnSim g_default_sim; // behind the dtnsim_* calls that take no context
+
+    class ContextScope {
+    public:
+        explicit ContextScope(DtnSim *sim) : prev_(g_sim) { g_sim = sim; }
+        ~ContextScope() { g_sim = prev_; }
+        ContextScope(const ContextScope &) = delete;
+        ContextScope &operator=(const ContextScope &) = delete;
+
+    private:
+        DtnSim *prev_;
+    };
+}
+
+namespace {
+    // Graph, placement and mobility randomness. Seeded runs use g_sim->sim_rng, so a seed
+    // gives the same run with every C library (glibc, musl in WASM, ...); unseeded runs
+    // keep drawing from rand().
+    inline uint32_t sim_rand() {
+        return g_sim->seeded ? static_cast<uint32_t>(g_sim->sim_rng.next() >> 33) : static_cast<uint32_t>(rand());
+    }
+    // Uniform in [0, 1]
+    inline float sim_rand_unit() {
+        return g_sim->seeded ? static_cast<float>(sim_rand()) / 2147483647.0f
+                        : static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
+    }
+
+    // MaxProp priority key (smaller = sent earlier, dropped later). Copies that have
+    // travelled fewer than MAXPROP_HOP_THRESHOLD hops go first, ordered by hop count;
+    // the rest by how often the holder has met the destination itself. This is a
+    // one-hop simplification of MaxProp's cost: it uses neither the likelihood vectors
+    // peers exchange nor shortest paths over them, which would take a table of every
+    // agent's vector per agent. Normalizing the holder's own meeting probabilities
+    // after a contact would scale every other destination by the same factor, so raw
+    // counts order the same way and only copies destined to the peer just met ever
+    // need re-keying.
+    inline double maxprop_direct_meeting_key(const Agent &holder, const Message &m) {
+        if (m.hops < MAXPROP_HOP_THRESHOLD) return static_cast<double>(m.hops);
+        const MaxPropMeeting *mt = holder.maxprop_meetings.find(m.dst - 1);
+        return MAXPROP_HOP_THRESHOLD + 1.0 / (1.0 + (mt ? mt->count : 0));
+    }
+
+    // --- Message bookkeeping ---
+    // g_sim->messages is the dense list of live messages exposed to JS; g_sim->message_meta
+    // is kept aligned with it and g_sim->message_pos maps a sequence number to its index.
+
+    inline int find_message_pos(uint32_t seq) {
+        const uint32_t *pos = g_sim->message_pos.find(seq);
+        return pos ? static_cast<int>(*pos) : -1;
+    }
+
+    // Register a new message; a non-zero ttl schedules its expiry on the wheel.
+    void add_message(const Message &m, double created_at) {
+        g_sim->message_pos.insert(m.seq, static_cast<uint32_t>(g_sim->messages.size()));
+        g_sim->messages.push_back(m);
+        g_sim->message_meta.push_back(MessageMeta{ created_at, 0, {} });
+        if (!g_sim->holder_pool.empty()) {
+            g_sim->message_meta.back().holders.swap(g_sim->holder_pool.back());
+            g_sim->holder_pool.pop_back();
+        }
+        if (m.ttl > 0) {
+            const double expires_at = created_at + static_cast<double>(m.ttl);
+            g_sim->expiry_wheel.schedule(static_cast<uint64_t>(std::ceil(expires_at / TTL_TICK)), m.seq);
+        }
+    }
 
-// Internal C++ graph and agent structures (use C ABI types from header)
-struct GraphNode {
-    float x, y, z;
-    std::vector<uint32_t> neighbors; // indices of neighboring graph nodes
-};
+    // Swap-remove the message at pos from the global list
+    void remove_message_at(uint32_t pos) {
+        const uint32_t last = static_cast<uint32_t>(g_sim->messages.size()) - 1;
+        g_sim->message_pos.erase(g_sim->messages[pos].seq);
+        if (pos != last) {
+            g_sim->messages[pos] = g_sim->messages[last];
+            std::swap(g_sim->message_meta[pos], g_sim->message_meta[last]);
+            *g_sim->message_pos.find(g_sim->messages[pos].seq) = pos;
+        }
+        g_sim->messages.pop_back();
+        // Keep the holder list's storage for the next message
+        g_sim->message_meta.back().holders.clear();
+        g_sim->holder_pool.push_back(std::move(g_sim->message_meta.back().holders));
+        g_sim->message_meta.pop_back();
+    }
 
-struct Agent {
-    uint32_t id;
-    uint32_t current_node; // index into graph nodes
-    uint32_t target_node;  // next node to walk toward
-    float progress;        // 0.0 - 1.0 along edge current_node -> target_node
-    float x, y, z;         // current interpolated position in space
-    std::vector<Message> messages; // messages currently held by this agent
-    bool has_initial = false;      // has this agent ever received the initial message?
-};
+    // Rebuild an agent's summary vector from its buffer, sized for growth
+    void rebuild_summary(Agent &ag) {
+        ag.summary.reset(ag.buffer.size() * 2);
+        ag.buffer.for_each([&](const Message &m) { ag.summary.add(m.seq); });
+    }
 
-// --- DTN Simulation State ---
-namespace {
-    std::vector<GraphNode> g_nodes; // static graph nodes
-    std::vector<Agent> g_agents;    // moving agents walking on the graph
-    std::vector<float> g_node_positions;  // [x0, y0, z0, ...] static node positions for rendering
-    std::vector<float> g_agent_positions; // [x0, y0, z0, ...] dynamic agent positions for rendering
-    std::vector<Message> g_messages; // global message list (one entry per active message)
-    std::vector<uint8_t> g_agent_delivered; // 0/1 per agent: ever received initial message
-    RoutingStats g_stats;
-    uint32_t g_node_count = 0;
-    uint32_t g_agent_count = 0;
-    uint32_t g_seq_counter = 0;
-    // 0: CarryOnly, 1: Epidemic
-    int g_routing_mode = 0;
+    inline bool immune_to(const Agent &ag, uint32_t seq) {
+        return std::binary_search(ag.immune.begin(), ag.immune.end(), seq);
+    }
 
-    // Spatial grid parameters
-    constexpr float COMM_RANGE = 80.0f; // reduced to ~0.4x of previous
-    constexpr float GRID_CELL_SIZE = COMM_RANGE; // cell size == comm range
-    constexpr float AGENT_SPEED = 150.0f; // units per second (spatial speed)
+    // Does the agent hold seq? In summary-vector mode the Bloom filter answers
+    // "absent" without touching the buffer's index. In immunity mode an agent
+    // carrying the message's anti-packet counts as holding it, so it is never
+    // offered the message again.
+    inline bool holds(const Agent &ag, uint32_t seq) {
+        if (g_sim->immunity && !ag.immune.empty() && immune_to(ag, seq)) return true;
+        if (g_sim->summary_vectors && !ag.summary.maybe_contains(seq)) return false;
+        return ag.buffer.contains(seq);
+    }
 
-    struct GridCellKey {
-        int gx, gy, gz;
-        bool operator==(const GridCellKey &o) const { return gx==o.gx && gy==o.gy && gz==o.gz; }
-    };
+    // Take seq out of an agent's buffer and the per-agent indexes over it
+    bool release_copy(Agent &ag, uint32_t seq) {
+        if (!ag.buffer.remove(seq)) return false;
+        if (g_sim->summary_vectors) ag.summary.remove(seq);
+        ag.maxprop_queue.remove(seq);
+        return true;
+    }
+
+    // Remove an agent's copy; the message leaves the system with its last copy
+    // once the log is flushed.
+    void drop_copy(uint32_t agent_idx, uint32_t seq, RoutingLog &log) {
+        if (!release_copy(g_sim->agents[agent_idx], seq)) return;
+        log.copies.push_back(CopyEvent{ seq, agent_idx, false });
+    }
 
-    struct GridCellKeyHash {
-        std::size_t operator()(const GridCellKey &k) const noexcept {
-            // simple integer hash
-            std::size_t h = 1469598103934665603ull;
-            h ^= (std::size_t)k.gx + 0x9e3779b97f4a7c15ull + (h<<6) + (h>>2);
-            h ^= (std::size_t)k.gy + 0x9e3779b97f4a7c15ull + (h<<6) + (h>>2);
-            h ^= (std::size_t)k.gz + 0x9e3779b97f4a7c15ull + (h<<6) + (h>>2);
-            return h;
+    // Evict one copy from a full buffer. MaxProp always drops its lowest-priority
+    // copy; the other routing modes use the configured drop policy.
+    void evict_one(uint32_t agent_idx, RoutingLog &log) {
+        Agent &ag = g_sim->agents[agent_idx];
+        const Message *victim = nullptr;
+        if (g_sim->routing_mode == 3) {
+            victim = ag.maxprop_queue.worst();
+        } else if (g_sim->drop_policy == 1) {
+            victim = ag.buffer.oldest_created();
+        } else if (g_sim->drop_policy == 2) {
+            victim = ag.buffer.youngest_created();
+        } else if (g_sim->drop_policy == 3) {
+            victim = ag.buffer.size() ? ag.buffer.at(ag.drop_rng.below(ag.buffer.size())) : nullptr;
+        } else {
+            victim = ag.buffer.first_arrived();
         }
-    };
+        if (!victim) return;
+        drop_copy(agent_idx, victim->seq, log);
+        log.stats.dropped++;
+    }
 
-    // Encounter pair within one step
-    struct Encounter {
-        uint32_t a_idx;
-        uint32_t b_idx;
-    };
+    // Add a copy to an agent's buffer (evicting first if it is full). The caller
+    // guarantees the agent does not already hold the message.
+    void store_copy(uint32_t agent_idx, const Message &copy, uint32_t arrival_step, RoutingLog &log) {
+        Agent &ag = g_sim->agents[agent_idx];
+        if (g_sim->buffer_capacity > 0 && ag.buffer.size() >= g_sim->buffer_capacity) {
+            evict_one(agent_idx, log);
+        }
+        ag.buffer.insert(copy, arrival_step);
+        log.copies.push_back(CopyEvent{ copy.seq, agent_idx, true });
+        if (g_sim->summary_vectors) {
+            if (ag.summary.full()) {
+                rebuild_summary(ag);
+            } else {
+                ag.summary.add(copy.seq);
+            }
+        }
+        if (g_sim->routing_mode == 3) {
+            ag.maxprop_queue.push(copy, maxprop_direct_meeting_key(ag, copy));
+        }
+    }
+
+    // Drop holder entries of agents that no longer hold the message
+    void compact_holders(uint32_t seq, MessageMeta &meta) {
+        std::vector<uint32_t> &holders = meta.holders;
+        holders.erase(std::remove_if(holders.begin(), holders.end(), [&](uint32_t h) {
+            return !g_sim->agents[h].buffer.contains(seq);
+        }), holders.end());
+        if (holders.size() > meta.copies) {
+            // An agent dropped and later re-took the message
+            std::sort(holders.begin(), holders.end());
+            holders.erase(std::unique(holders.begin(), holders.end()), holders.end());
+        }
+    }
+
+    void histogram_add(Histogram &h, uint64_t v) {
+        uint32_t b = 0;
+        while (b + 1 < DTNSIM_HISTOGRAM_BUCKETS && (v >> b) != 0) ++b;
+        h.buckets[b]++;
+        h.count++;
+        h.sum += v;
+        h.max = std::max(h.max, v);
+    }
+
+    void add_stats(RoutingStats &to, const RoutingStats &d) {
+        to.delivered += d.delivered;
+        to.tx += d.tx;
+        to.rx += d.rx;
+        to.duplicates += d.duplicates;
+        to.dropped += d.dropped;
+        to.expired += d.expired;
+        to.created += d.created;
+        to.duplicate_offers += d.duplicate_offers;
+        to.immunized += d.immunized;
+    }
+
+    // Remove the messages whose last copy went away during the preceding flushes.
+    // A bulk-synchronous step may still store a copy of such a message (sent before
+    // the sender dropped it) in a log flushed later, so removal waits until all
+    // logs of a phase are flushed.
+    void remove_copyless() {
+        for (uint32_t seq : g_sim->copyless) {
+            const int pos = find_message_pos(seq);
+            if (pos >= 0 && g_sim->message_meta[pos].copies == 0) {
+                remove_message_at(static_cast<uint32_t>(pos));
+            }
+        }
+        g_sim->copyless.clear();
+    }
+
+    // Apply a log's shared effects in the order they were recorded
+    void flush_log(RoutingLog &log) {
+        for (const CopyEvent &ev : log.copies) {
+            const int pos = find_message_pos(ev.seq);
+            if (pos < 0) continue;
+            MessageMeta &meta = g_sim->message_meta[pos];
+            if (ev.stored) {
+                meta.holders.push_back(ev.agent_idx);
+                meta.copies++;
+            } else if (--meta.copies == 0) {
+                g_sim->copyless.push_back(ev.seq);
+            } else if (meta.holders.size() >= 2 * static_cast<size_t>(meta.copies) + 8) {
+                compact_holders(ev.seq, meta);
+            }
+        }
+        log.copies.clear();
+        g_sim->reached_destination.insert(g_sim->reached_destination.end(), log.reached.begin(), log.reached.end());
+        log.reached.clear();
+        add_stats(g_sim->stats, log.stats);
+        log.stats = RoutingStats{};
+    }
+
+    // Size the storage a run fills as it goes up front, so that steps do not allocate
+    // while it does: the step scratch and per-step message lists from the agent
+    // count, agent buffers from the buffer capacity (one copy, the initial message,
+    // when unbounded) and the routing tables of the current mode. Called by
+    // dtnsim_init and by the setters these bounds depend on.
+    void reserve_run_storage() {
+        const uint32_t n = g_sim->agent_count;
+        if (n == 0) return;
+        const size_t encounters = static_cast<size_t>(n) * ENCOUNTERS_PER_AGENT;
+        StepScratch &scratch = g_sim->scratch;
+        scratch.cell_agents.reserve(n);
+        scratch.cells.reserve(n);
+        scratch.encounters.reserve(encounters);
+        scratch.contact_of.reserve(encounters);
+        scratch.enc_round.reserve(encounters);
+        scratch.order.reserve(encounters);
+        scratch.next_round.reserve(n);
+        scratch.round_start.reserve(n + 1); // an agent's encounters, one per round, bound the rounds
+        scratch.fill.reserve(n + 1);
+        scratch.fresh.reserve(n);
+
+        g_sim->reached_destination.reserve(n);
+        g_sim->copyless.reserve(n);
+        g_sim->holder_pool.reserve(n);
+        const int initial = find_message_pos(1);
+        if (initial >= 0) g_sim->message_meta[initial].holders.reserve(n);
+        const bool tables = n <= ROUTING_TABLE_RESERVE_AGENTS;
+        const uint32_t threads = g_sim->thread_count > 0 ? g_sim->thread_count : 1;
+        if (g_sim->worker_logs.size() < threads) g_sim->worker_logs.resize(threads);
+        g_sim->log.copies.reserve(n);
+        g_sim->log.reached.reserve(n);
+        for (RoutingLog &log : g_sim->worker_logs) {
+            log.copies.reserve(n);
+            log.reached.reserve(n);
+            if (g_sim->routing_mode == 2 && tables) log.prophet_updates.reserve(2 * static_cast<size_t>(n));
+            if (g_sim->routing_mode == 4) log.outbox.reserve(n);
+        }
+        if (g_sim->routing_mode == 4) scratch.inbox.reserve(n);
+        if (g_sim->link_rate > 0.0) {
+            g_sim->contacts.reserve(static_cast<uint32_t>(encounters));
+            g_sim->contacts_prev.reserve(static_cast<uint32_t>(encounters));
+        }
+        const uint32_t held = g_sim->buffer_capacity > 0 ? g_sim->buffer_capacity : 1;
+        for (Agent &a : g_sim->agents) {
+            a.buffer.reserve(held);
+            if (g_sim->summary_vectors && a.summary.full()) rebuild_summary(a);
+            if (g_sim->routing_mode == 2 && tables) {
+                a.prophet.reserve(n - 1);
+            } else if (g_sim->routing_mode == 3) {
+                a.maxprop_queue.reserve(held);
+                if (tables) a.maxprop_meetings.reserve(n - 1);
+            }
+        }
+    }
+
+    // Create a message from src to dst (agent indices) and hand its first copy to src
+    void create_message(uint32_t src_idx, uint32_t dst_idx, uint32_t ttl, uint32_t size, double created_at) {
+        Message m;
+        m.src = g_sim->agents[src_idx].id;
+        m.dst = g_sim->agents[dst_idx].id;
+        m.seq = ++g_sim->seq_counter;
+        m.ttl = ttl; // 0 means "no expiry"
+        m.hops = 0;
+        m.size = size;
+        add_message(m, created_at);
+#ifdef DTNSIM_REFERENCE
+        if (g_sim->ref.active) g_sim->ref.created.push_back(RefCreation{ m, created_at, src_idx });
+#endif
+        store_copy(src_idx, m, 0, g_sim->log);
+        g_sim->log.stats.created++;
+        flush_log(g_sim->log);
+        remove_copyless();
+    }
+
+    // Later time (then later arrival) sorts first, so std::push_heap keeps the earliest on top
+    inline bool injection_after(const PendingInjection &x, const PendingInjection &y) {
+        if (x.rec.at_ms != y.rec.at_ms) return x.rec.at_ms > y.rec.at_ms;
+        return x.order > y.order;
+    }
+
+    // Validate one injection record and create its message now
+    bool inject_now(const MessageInjection &r, double created_at) {
+        const uint32_t src_idx = r.src - 1;
+        const uint32_t dst_idx = r.dst - 1;
+        if (src_idx >= g_sim->agents.size() || dst_idx >= g_sim->agents.size() || src_idx == dst_idx) return false;
+        create_message(src_idx, dst_idx, r.ttl, r.size ? r.size : g_sim->default_message_size, created_at);
+        return true;
+    }
+
+    // Number of arrivals of a Poisson process with the given mean. The mean is split
+    // into chunks sampled by inversion, so the cost grows with the number of arrivals.
+    uint32_t sample_poisson(SplitMix64 &rng, double mean) {
+        uint32_t n = 0;
+        while (mean > 0.0) {
+            const double chunk = mean < 32.0 ? mean : 32.0;
+            mean -= chunk;
+            double p = std::exp(-chunk);
+            double cdf = p;
+            const double u = rng.uniform();
+            uint32_t k = 0;
+            while (u > cdf && p > 0.0) {
+                ++k;
+                p *= chunk / k;
+                cdf += p;
+            }
+            n += k;
+        }
+        return n;
+    }
+
+    // Pick the hotspot destinations (distinct agents) once the agent set is known
+    void select_hotspots() {
+        const uint32_t n = static_cast<uint32_t>(g_sim->agents.size());
+        const uint32_t want = g_sim->hotspot_count < n ? g_sim->hotspot_count : n;
+        if (g_sim->hotspots.size() == want) return;
+        std::vector<uint32_t> pool(n);
+        for (uint32_t i = 0; i < n; ++i) pool[i] = i;
+        for (uint32_t i = 0; i < want; ++i) {
+            std::swap(pool[i], pool[i + g_sim->traffic_rng.below(n - i)]);
+        }
+        g_sim->hotspots.assign(pool.begin(), pool.begin() + want);
+    }
+
+    // Remove every copy of a message and the message itself. Walks the message's
+    // holder list, so the cost is proportional to its copies.
+    void purge_message(uint32_t seq) {
+        const int pos = find_message_pos(seq);
+        if (pos < 0) return;
+        for (uint32_t h : g_sim->message_meta[pos].holders) {
+            release_copy(g_sim->agents[h], seq);
+        }
+        remove_message_at(static_cast<uint32_t>(pos));
+    }
+
+    // Immunity mode: two agents in contact merge their anti-packets, and each drops
+    // its copies of the messages it just learned were delivered. Ids of messages
+    // that have left the system are pruned on the way, which keeps the lists bounded
+    // by the delivered messages still having copies. Touches only the two agents.
+    void exchange_immunity(uint32_t a_idx, uint32_t b_idx, RoutingLog &log) {
+        Agent &a = g_sim->agents[a_idx];
+        Agent &b = g_sim->agents[b_idx];
+        if (a.immune == b.immune) return;
+        std::vector<uint32_t> &merged = log.immune_merge;
+        merged.clear();
+        auto learn = [&](uint32_t idx, uint32_t seq) {
+            if (g_sim->agents[idx].buffer.contains(seq)) {
+                drop_copy(idx, seq, log);
+                log.stats.immunized++;
+            }
+        };
+        size_t i = 0, j = 0;
+        while (i < a.immune.size() || j < b.immune.size()) {
+            const uint32_t sa = i < a.immune.size() ? a.immune[i] : UINT32_MAX;
+            const uint32_t sb = j < b.immune.size() ? b.immune[j] : UINT32_MAX;
+            const uint32_t seq = std::min(sa, sb);
+            if (sa == seq) ++i;
+            if (sb == seq) ++j;
+            if (find_message_pos(seq) < 0) continue;
+            if (sa != seq) learn(a_idx, seq);
+            if (sb != seq) learn(b_idx, seq);
+            merged.push_back(seq);
+        }
+        a.immune = merged;
+        b.immune = merged;
+    }
+
+    // Immunity mode for the bulk-synchronous epidemic: every agent in an encounter
+    // learns the anti-packets its peers carried when the step started, which keeps
+    // the result independent of encounter order (anti-packets travel one hop per
+    // step, like the messages themselves in that mode).
+    void spread_immunity(const std::vector<Encounter> &encounters) {
+        auto dead = [](uint32_t seq) { return find_message_pos(seq) < 0; };
+        for (const Encounter &enc : encounters) {
+            for (uint32_t idx : { enc.a_idx, enc.b_idx }) {
+                std::vector<uint32_t> &immune = g_sim->agents[idx].immune;
+                immune.erase(std::remove_if(immune.begin(), immune.end(), dead), immune.end());
+            }
+        }
+
+        std::vector<std::pair<uint32_t, uint32_t>> &learned = g_sim->scratch.learned; // (agent index, seq)
+        learned.clear();
+        auto send = [&](uint32_t from_idx, uint32_t to_idx) {
+            const std::vector<uint32_t> &have = g_sim->agents[to_idx].immune;
+            auto it = have.begin();
+            for (uint32_t seq : g_sim->agents[from_idx].immune) {
+                while (it != have.end() && *it < seq) ++it;
+                if (it == have.end() || *it != seq) learned.push_back({ to_idx, seq });
+            }
+        };
+        for (const Encounter &enc : encounters) {
+            send(enc.a_idx, enc.b_idx);
+            send(enc.b_idx, enc.a_idx);
+        }
+        if (learned.empty()) return;
+        std::sort(learned.begin(), learned.end());
+        learned.erase(std::unique(learned.begin(), learned.end()), learned.end());
+
+        for (size_t i = 0; i < learned.size();) {
+            const uint32_t idx = learned[i].first;
+            Agent &ag = g_sim->agents[idx];
+            const size_t old_size = ag.immune.size();
+            for (; i < learned.size() && learned[i].first == idx; ++i) {
+                const uint32_t seq = learned[i].second;
+                ag.immune.push_back(seq);
+                if (ag.buffer.contains(seq)) {
+                    drop_copy(idx, seq, g_sim->log);
+                    g_sim->log.stats.immunized++;
+                }
+            }
+            std::inplace_merge(ag.immune.begin(), ag.immune.begin() + old_size, ag.immune.end());
+        }
+        flush_log(g_sim->log);
+        remove_copyless();
+    }
 
     // Utility: compute grid key
     inline GridCellKey cell_for(const Agent &a) {
@@ -74,6 +1798,579 @@ namespace {
             static_cast<int>(a.z / GRID_CELL_SIZE)
         };
     }
+
+    // Static graph: link every node with its K nearest nodes (undirected, without
+    // duplicate edges). Nodes are bucketed into a uniform grid of about two nodes per
+    // cell, and each search visits the shells of cells around the node's own cell
+    // outward until no unvisited cell can hold a node closer than the K-th one found.
+    // Ties are broken by node index. The edges are those of an all-pairs scan.
+    void build_knn_edges(Graph &graph, uint32_t K) {
+        std::vector<GraphNode> &nodes = graph.nodes;
+        const uint32_t n = static_cast<uint32_t>(nodes.size());
+        if (n < 2) return;
+        K = std::min(K, n - 1);
+
+        float lo[3] = { nodes[0].x, nodes[0].y, nodes[0].z };
+        float hi[3] = { lo[0], lo[1], lo[2] };
+        for (const GraphNode &nd : nodes) {
+            const float p[3] = { nd.x, nd.y, nd.z };
+            for (int a = 0; a < 3; ++a) {
+                lo[a] = std::min(lo[a], p[a]);
+                hi[a] = std::max(hi[a], p[a]);
+            }
+        }
+        const int G = std::max(1, static_cast<int>(std::cbrt(n / 2.0)));
+        const float extent = std::max({ hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2] });
+        const float cell = extent > 0.0f ? extent / static_cast<float>(G) : 1.0f;
+        auto coord = [&](float v, int a) {
+            return std::min(G - 1, static_cast<int>((v - lo[a]) / cell));
+        };
+        auto cell_index = [&](int x, int y, int z) {
+            return (static_cast<size_t>(z) * G + y) * G + x;
+        };
+
+        // Counting sort of the nodes by cell
+        std::vector<uint32_t> cell_start(static_cast<size_t>(G) * G * G + 1, 0);
+        std::vector<uint32_t> node_cell(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            const GraphNode &nd = nodes[i];
+            node_cell[i] = static_cast<uint32_t>(cell_index(coord(nd.x, 0), coord(nd.y, 1), coord(nd.z, 2)));
+            cell_start[node_cell[i] + 1]++;
+        }
+        for (size_t c = 1; c < cell_start.size(); ++c) cell_start[c] += cell_start[c - 1];
+        std::vector<uint32_t> cell_nodes(n);
+        {
+            std::vector<uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+            for (uint32_t i = 0; i < n; ++i) cell_nodes[fill[node_cell[i]]++] = i;
+        }
+
+        struct DistIdx { float d2; uint32_t j; };
+        std::vector<DistIdx> best; // the K nearest so far, ascending by (d2, j)
+        best.reserve(K + 1);
+        for (uint32_t i = 0; i < n; ++i) {
+            const GraphNode &ni = nodes[i];
+            const int cx = coord(ni.x, 0), cy = coord(ni.y, 1), cz = coord(ni.z, 2);
+            auto scan = [&](size_t c) {
+                for (uint32_t k = cell_start[c]; k < cell_start[c + 1]; ++k) {
+                    const uint32_t j = cell_nodes[k];
+                    if (j == i) continue;
+                    const GraphNode &nj = nodes[j];
+                    float dx = ni.x - nj.x;
+                    float dy = ni.y - nj.y;
+                    float dz = ni.z - nj.z;
+                    float d2 = dx*dx + dy*dy + dz*dz;
+                    if (best.size() == K && !(d2 < best.back().d2 || (d2 == best.back().d2 && j < best.back().j))) continue;
+                    size_t pos = best.size();
+                    while (pos > 0 && (d2 < best[pos - 1].d2 || (d2 == best[pos - 1].d2 && j < best[pos - 1].j))) --pos;
+                    best.insert(best.begin() + pos, DistIdx{ d2, j });
+                    if (best.size() > K) best.pop_back();
+                }
+            };
+            best.clear();
+            for (int r = 0; ; ++r) {
+                // Cells at Chebyshev distance r from the node's cell
+                for (int z = std::max(0, cz - r); z <= std::min(G - 1, cz + r); ++z) {
+                    for (int y = std::max(0, cy - r); y <= std::min(G - 1, cy + r); ++y) {
+                        if (std::abs(z - cz) == r || std::abs(y - cy) == r) {
+                            for (int x = std::max(0, cx - r); x <= std::min(G - 1, cx + r); ++x) scan(cell_index(x, y, z));
+                        } else {
+                            if (cx - r >= 0) scan(cell_index(cx - r, y, z));
+                            if (cx + r < G) scan(cell_index(cx + r, y, z));
+                        }
+                    }
+                }
+                // Nodes in farther shells are at least r cells away (with a margin for
+                // rounding in coord())
+                const float reach = static_cast<float>(r) * cell * 0.999f;
+                if (best.size() == K && best.back().d2 <= reach * reach) break;
+                if (r >= G) break;
+            }
+            for (const DistIdx &e : best) {
+                const uint32_t j = e.j;
+                // add undirected edge i <-> j (avoid obvious duplicates)
+                if (std::find(nodes[i].neighbors.begin(), nodes[i].neighbors.end(), j) == nodes[i].neighbors.end()) {
+                    nodes[i].neighbors.push_back(j);
+                }
+                if (std::find(nodes[j].neighbors.begin(), nodes[j].neighbors.end(), i) == nodes[j].neighbors.end()) {
+                    nodes[j].neighbors.push_back(i);
+                }
+            }
+        }
+    }
+
+    // Place node_count graph nodes uniformly in the world box and link them
+    std::shared_ptr<Graph> build_graph(uint32_t node_count) {
+        std::shared_ptr<Graph> graph = std::make_shared<Graph>();
+        graph->nodes.reserve(node_count);
+        graph->positions.reserve(static_cast<size_t>(node_count) * 3);
+        for (uint32_t i = 0; i < node_count; ++i) {
+            GraphNode n;
+            n.x = sim_rand_unit() * g_sim->world_size;
+            n.y = sim_rand_unit() * g_sim->world_size;
+            n.z = sim_rand_unit() * g_sim->world_size;
+            graph->nodes.push_back(n);
+            graph->positions.push_back(n.x);
+            graph->positions.push_back(n.y);
+            graph->positions.push_back(n.z);
+        }
+        build_knn_edges(*graph, 3); // neighbors per node
+        return graph;
+    }
+
+    // Graphs of seeded runs by (graph seed, node count, world size), held weakly: a
+    // graph lives while a simulation uses it, and simulations in any thread that ask
+    // for the same key meanwhile share it instead of building their own
+    struct GraphKey {
+        uint32_t seed;
+        uint32_t node_count;
+        float world_size;
+        bool operator<(const GraphKey &o) const {
+            if (seed != o.seed) return seed < o.seed;
+            if (node_count != o.node_count) return node_count < o.node_count;
+            return world_size < o.world_size;
+        }
+    };
+    std::mutex g_graph_cache_mutex;
+    std::map<GraphKey, std::weak_ptr<const Graph>> g_graph_cache;
+
+    // The graph of a seeded run drawn from graph_seed. Building happens under the lock,
+    // so concurrent inits with the same key build it once.
+    std::shared_ptr<const Graph> shared_graph(uint32_t graph_seed, uint32_t node_count) {
+        const GraphKey key{ graph_seed, node_count, g_sim->world_size };
+        std::lock_guard<std::mutex> lock(g_graph_cache_mutex);
+        auto it = g_graph_cache.find(key);
+        if (it != g_graph_cache.end()) {
+            if (std::shared_ptr<const Graph> graph = it->second.lock()) return graph;
+        }
+        for (auto e = g_graph_cache.begin(); e != g_graph_cache.end();) {
+            e = e->second.expired() ? g_graph_cache.erase(e) : std::next(e);
+        }
+        g_sim->sim_rng.state = 0x452821e638d01377ull ^ graph_seed;
+        std::shared_ptr<const Graph> graph = build_graph(node_count);
+        g_graph_cache[key] = graph;
+        return graph;
+    }
+
+    // --- Epidemic ensemble (routing mode 5) ---
+
+    // Place the replicas of an ensemble run on their sources. first_source is where the
+    // initial message of the other modes would start.
+    void start_ensemble(uint32_t first_source) {
+        EnsembleStats &es = g_sim->ensemble;
+        const uint32_t n = g_sim->agent_count;
+        for (uint32_t src : g_sim->ensemble_sources) {
+            if (src < n) es.sources[es.replicas++] = src;
+        }
+        if (es.replicas == 0) {
+            es.replicas = std::min<uint32_t>(DTNSIM_ENSEMBLE_REPLICAS, n);
+            for (uint32_t r = 0; r < es.replicas; ++r) {
+                es.sources[r] = static_cast<uint32_t>((first_source + static_cast<uint64_t>(r) * n / es.replicas) % n);
+            }
+        }
+        g_sim->ensemble_held.assign(n, 0);
+        for (uint32_t r = 0; r < es.replicas; ++r) {
+            g_sim->ensemble_held[es.sources[r]] |= 1ull << r;
+            es.reached[r] = 1;
+        }
+    }
+
+    // Pass every replica across each encounter. Both directions offer the masks from
+    // before routing, so a copy moves one hop per step as in Epidemic. Replica 0 is
+    // also accounted in RoutingStats and the delivered flags.
+    void route_ensemble(const std::vector<Encounter> &encounters) {
+        EnsembleStats &es = g_sim->ensemble;
+        if (es.full_spread == es.replicas) return;
+        std::vector<uint64_t> &held = g_sim->ensemble_held;
+        std::vector<uint64_t> &before = g_sim->ensemble_before;
+        before.assign(held.begin(), held.end());
+        const uint32_t n = g_sim->agent_count;
+        auto receive = [&](uint32_t idx, uint64_t offered) {
+            uint64_t fresh = offered & ~held[idx];
+            if (!fresh) return;
+            held[idx] |= fresh;
+            if (fresh & 1) {
+                g_sim->stats.tx++;
+                g_sim->stats.rx++;
+                g_sim->stats.delivered++;
+                g_sim->agents[idx].has_initial = true;
+                g_sim->agent_delivered[idx] = 1;
+            }
+            do {
+                const uint32_t r = ctz64(fresh);
+                if (++es.reached[r] == n) {
+                    es.full_spread_step[r] = g_sim->step_index;
+                    es.full_spread++;
+                }
+                fresh &= fresh - 1;
+            } while (fresh);
+        };
+        for (const Encounter &enc : encounters) {
+            const uint64_t a = before[enc.a_idx];
+            const uint64_t b = before[enc.b_idx];
+            if (a == b) continue;
+            receive(enc.b_idx, a);
+            receive(enc.a_idx, b);
+        }
+    }
+
+#ifdef DTNSIM_REFERENCE
+    // --- Reference engine (differential mode) ---
+
+    // Why the current configuration is outside what the reference implements (nullptr = covered)
+    const char* ref_unsupported() {
+        if (!g_sim->seeded) return "differential mode needs a seeded run (dtnsim_set_seed)";
+        if (g_sim->routing_mode != 0 && g_sim->routing_mode != 1 && g_sim->routing_mode != 4) {
+            return "the reference covers carryonly, epidemic and epidemic_bsp only";
+        }
+        if (g_sim->link_rate > 0.0) return "the reference does not model link rates";
+        if (g_sim->drop_policy == 3) return "the reference does not model the random drop policy";
+        if (g_sim->immunity) return "the reference does not model immunity";
+        return nullptr;
+    }
+
+    RefCopy* ref_find(RefAgent &ag, uint32_t seq) {
+        for (RefCopy &c : ag.buffer) {
+            if (c.msg.seq == seq) return &c;
+        }
+        return nullptr;
+    }
+
+    // Add a copy, evicting by the drop policy first if the buffer is full
+    void ref_store(uint32_t agent_idx, const Message &copy, uint32_t arrival_step) {
+        std::vector<RefCopy> &buffer = g_sim->ref.agents[agent_idx].buffer;
+        if (g_sim->buffer_capacity > 0 && buffer.size() >= g_sim->buffer_capacity && !buffer.empty()) {
+            size_t victim = 0; // drop-head: the first arrived
+            for (size_t k = 1; k < buffer.size(); ++k) {
+                const uint32_t seq = buffer[k].msg.seq;
+                if ((g_sim->drop_policy == 1 && seq < buffer[victim].msg.seq) ||
+                    (g_sim->drop_policy == 2 && seq > buffer[victim].msg.seq)) {
+                    victim = k;
+                }
+            }
+            buffer.erase(buffer.begin() + victim);
+            g_sim->ref.stats.dropped++;
+        }
+        buffer.push_back(RefCopy{ copy, arrival_step });
+    }
+
+    void ref_purge(uint32_t seq) {
+        for (RefAgent &ag : g_sim->ref.agents) {
+            ag.buffer.erase(std::remove_if(ag.buffer.begin(), ag.buffer.end(),
+                                           [&](const RefCopy &c) { return c.msg.seq == seq; }),
+                            ag.buffer.end());
+        }
+        g_sim->ref.messages.erase(seq);
+    }
+
+    // Drop the messages nobody holds a copy of
+    void ref_remove_copyless() {
+        std::set<uint32_t> held;
+        for (const RefAgent &ag : g_sim->ref.agents) {
+            for (const RefCopy &c : ag.buffer) held.insert(c.msg.seq);
+        }
+        for (auto it = g_sim->ref.messages.begin(); it != g_sim->ref.messages.end();) {
+            it = held.count(it->first) ? std::next(it) : g_sim->ref.messages.erase(it);
+        }
+    }
+
+    void ref_transfer(uint32_t to_idx, const Message &m) {
+        Message copy = m;
+        copy.hops++;
+        ref_store(to_idx, copy, g_sim->ref.step_index);
+        if (to_idx + 1 == m.dst) g_sim->ref.reached.push_back(m.seq);
+        g_sim->ref.stats.tx++;
+        g_sim->ref.stats.rx++;
+        RefAgent &to = g_sim->ref.agents[to_idx];
+        if (m.seq == 1 && !to.has_initial) {
+            to.has_initial = true;
+            g_sim->ref.stats.delivered++;
+        }
+    }
+
+    // CarryOnly / Epidemic: everything from_idx sends to_idx in one encounter
+    void ref_send(uint32_t from_idx, uint32_t to_idx) {
+        RefAgent &from = g_sim->ref.agents[from_idx];
+        for (size_t k = 0; k < from.buffer.size(); ++k) {
+            const Message m = from.buffer[k].msg;
+            const bool fresh = from.buffer[k].arrival_step == g_sim->ref.step_index;
+            if (g_sim->routing_mode == 0 && to_idx + 1 != m.dst) continue;
+            if (ref_find(g_sim->ref.agents[to_idx], m.seq)) {
+                if (g_sim->routing_mode == 0 || !fresh) g_sim->ref.stats.duplicate_offers++;
+                continue;
+            }
+            if (g_sim->routing_mode == 1 && fresh) continue;
+            ref_transfer(to_idx, m);
+        }
+    }
+
+    // Start the reference from a copy of the state dtnsim_init just built
+    void ref_start() {
+        g_sim->ref = ReferenceEngine{};
+        g_sim->divergence.clear();
+        if (!g_sim->differential) return;
+        if (const char *why = ref_unsupported()) {
+            g_sim->divergence = std::string("reference not started: ") + why;
+            return;
+        }
+        for (const Agent &a : g_sim->agents) {
+            RefAgent r{ a.current_node, a.target_node, a.progress, a.x, a.y, a.z, a.has_initial, {} };
+            a.buffer.for_each([&](const Message &m) {
+                r.buffer.push_back(RefCopy{ m, a.buffer.arrival_step(m.seq) });
+            });
+            g_sim->ref.agents.push_back(r);
+        }
+        for (size_t i = 0; i < g_sim->messages.size(); ++i) {
+            g_sim->ref.messages[g_sim->messages[i].seq] = RefMessage{ g_sim->messages[i], g_sim->message_meta[i].created_at };
+        }
+        g_sim->ref.stats = g_sim->stats;
+        g_sim->ref.rng = g_sim->sim_rng;
+        g_sim->ref.sim_time = g_sim->sim_time;
+        g_sim->ref.step_index = g_sim->step_index;
+        g_sim->ref.active = true;
+    }
+
+    // Record the first divergence and stop the reference
+    void ref_diverged(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+    void ref_diverged(const char *fmt, ...) {
+        char text[512];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "step %u: ", g_sim->ref.step_index);
+        g_sim->divergence = std::string(prefix) + text;
+        g_sim->ref.active = false;
+    }
+
+    // Compare the reference with the optimized engine after a step; stops at the first difference
+    void ref_compare() {
+        // A follower routed over its leader's encounters
+        const std::vector<Encounter> &encounters = (g_sim->leader ? g_sim->leader : g_sim)->scratch.encounters;
+        if (encounters.size() != g_sim->ref.encounters.size()) {
+            ref_diverged("%zu encounters in the reference, %zu in the optimized engine",
+                         g_sim->ref.encounters.size(), encounters.size());
+            return;
+        }
+        for (size_t e = 0; e < encounters.size(); ++e) {
+            const Encounter &r = g_sim->ref.encounters[e];
+            const Encounter &o = encounters[e];
+            if (r.a_idx != o.a_idx || r.b_idx != o.b_idx) {
+                ref_diverged("encounter %zu is %u-%u in the reference, %u-%u in the optimized engine",
+                             e, r.a_idx + 1, r.b_idx + 1, o.a_idx + 1, o.b_idx + 1);
+                return;
+            }
+        }
+        std::vector<RefCopy> held;
+        for (uint32_t i = 0; i < g_sim->agents.size(); ++i) {
+            const Agent &a = g_sim->agents[i];
+            const RefAgent &r = g_sim->ref.agents[i];
+            if (a.x != r.x || a.y != r.y || a.z != r.z || a.progress != r.progress ||
+                a.current_node != r.current_node || a.target_node != r.target_node) {
+                ref_diverged("agent %u is at (%.9g, %.9g, %.9g) on edge %u->%u in the reference, "
+                             "(%.9g, %.9g, %.9g) on edge %u->%u in the optimized engine",
+                             a.id, r.x, r.y, r.z, r.current_node, r.target_node,
+                             a.x, a.y, a.z, a.current_node, a.target_node);
+                return;
+            }
+            if (a.has_initial != r.has_initial) {
+                ref_diverged("agent %u %s the initial message in the reference only", a.id,
+                             r.has_initial ? "received" : "did not receive");
+                return;
+            }
+            held.clear();
+            a.buffer.for_each([&](const Message &m) { held.push_back(RefCopy{ m, a.buffer.arrival_step(m.seq) }); });
+            if (held.size() != r.buffer.size()) {
+                ref_diverged("agent %u holds %zu copies in the reference, %zu in the optimized engine",
+                             a.id, r.buffer.size(), held.size());
+                return;
+            }
+            for (size_t k = 0; k < held.size(); ++k) {
+                const RefCopy &rc = r.buffer[k];
+                const RefCopy &oc = held[k];
+                if (rc.msg.seq != oc.msg.seq || rc.msg.hops != oc.msg.hops || rc.arrival_step != oc.arrival_step ||
+                    memcmp(&rc.msg, &oc.msg, sizeof(Message)) != 0) {
+                    ref_diverged("copy %zu of agent %u is seq %u (%u hops, arrived in step %u) in the reference, "
+                                 "seq %u (%u hops, arrived in step %u) in the optimized engine",
+                                 k, a.id, rc.msg.seq, rc.msg.hops, rc.arrival_step,
+                                 oc.msg.seq, oc.msg.hops, oc.arrival_step);
+                    return;
+                }
+            }
+        }
+        if (g_sim->messages.size() != g_sim->ref.messages.size()) {
+            ref_diverged("%zu live messages in the reference, %zu in the optimized engine",
+                         g_sim->ref.messages.size(), g_sim->messages.size());
+            return;
+        }
+        for (const Message &m : g_sim->messages) {
+            if (!g_sim->ref.messages.count(m.seq)) {
+                ref_diverged("message %u is live in the optimized engine only", m.seq);
+                return;
+            }
+        }
+        const struct {
+            const char *name;
+            uint64_t RoutingStats::*field;
+        } counters[] = {
+            { "delivered", &RoutingStats::delivered }, { "tx", &RoutingStats::tx },
+            { "rx", &RoutingStats::rx }, { "duplicates", &RoutingStats::duplicates },
+            { "dropped", &RoutingStats::dropped }, { "expired", &RoutingStats::expired },
+            { "created", &RoutingStats::created }, { "duplicate_offers", &RoutingStats::duplicate_offers },
+            { "immunized", &RoutingStats::immunized },
+        };
+        for (const auto &c : counters) {
+            if (g_sim->stats.*c.field != g_sim->ref.stats.*c.field) {
+                ref_diverged("%s is %llu in the reference, %llu in the optimized engine", c.name,
+                             static_cast<unsigned long long>(g_sim->ref.stats.*c.field),
+                             static_cast<unsigned long long>(g_sim->stats.*c.field));
+                return;
+            }
+        }
+    }
+
+    // One step of the reference, then the comparison. Same phases as dtnsim_step.
+    void ref_step(double dt) {
+        g_sim->ref.step_index++;
+        if (const char *why = ref_unsupported()) {
+            ref_diverged("reference stopped: %s", why);
+            return;
+        }
+        const uint32_t n = static_cast<uint32_t>(g_sim->ref.agents.size());
+        g_sim->ref.sim_time += dt;
+
+        // 0. Messages the optimized engine created since the last step
+        for (const RefCreation &c : g_sim->ref.created) {
+            g_sim->ref.messages[c.msg.seq] = RefMessage{ c.msg, c.created_at };
+            ref_store(c.src_idx, c.msg, 0);
+            g_sim->ref.stats.created++;
+        }
+        g_sim->ref.created.clear();
+        ref_remove_copyless();
+
+        // 1. Mobility
+        const float fdt = static_cast<float>(dt);
+        const std::vector<GraphNode> &nodes = g_sim->graph->nodes;
+        for (RefAgent &a : g_sim->ref.agents) {
+            if (nodes.empty()) continue;
+            const GraphNode &src = nodes[a.current_node];
+            const GraphNode &dst = nodes[a.target_node];
+            float dx = dst.x - src.x;
+            float dy = dst.y - src.y;
+            float dz = dst.z - src.z;
+            float len = std::sqrt(dx*dx + dy*dy + dz*dz);
+            if (len < 1e-3f) {
+                a.progress = 1.0f;
+            } else {
+                a.progress += (AGENT_SPEED * fdt) / len;
+                if (a.progress > 1.0f) a.progress = 1.0f;
+            }
+            a.x = src.x + dx * a.progress;
+            a.y = src.y + dy * a.progress;
+            a.z = src.z + dz * a.progress;
+            if (a.progress >= 1.0f) {
+                a.current_node = a.target_node;
+                const GraphNode &cur = nodes[a.current_node];
+                if (!cur.neighbors.empty()) {
+                    a.target_node = cur.neighbors[static_cast<uint32_t>(g_sim->ref.rng.next() >> 33) % cur.neighbors.size()];
+                    a.progress = 0.0f;
+                }
+            }
+        }
+
+        // 2. Encounters: every pair in range, listed in the order the grid search
+        // visits them (by agent, then by neighbor cell, then by peer index)
+        auto cell_of = [](const RefAgent &a) {
+            return GridCellKey{ static_cast<int>(a.x / GRID_CELL_SIZE), static_cast<int>(a.y / GRID_CELL_SIZE),
+                                static_cast<int>(a.z / GRID_CELL_SIZE) };
+        };
+        g_sim->ref.encounters.clear();
+        std::vector<std::pair<int, uint32_t>> peers; // (neighbor cell rank, peer)
+        for (uint32_t i = 0; i < n; ++i) {
+            const RefAgent &ai = g_sim->ref.agents[i];
+            const GridCellKey ci = cell_of(ai);
+            peers.clear();
+            for (uint32_t j = i + 1; j < n; ++j) {
+                const RefAgent &aj = g_sim->ref.agents[j];
+                const float dxp = ai.x - aj.x;
+                const float dyp = ai.y - aj.y;
+                const float dzp = ai.z - aj.z;
+                if (dxp*dxp + dyp*dyp + dzp*dzp > COMM_RANGE * COMM_RANGE) continue;
+                const GridCellKey cj = cell_of(aj);
+                const int ox = cj.gx - ci.gx, oy = cj.gy - ci.gy, oz = cj.gz - ci.gz;
+                const bool adjacent = std::abs(ox) <= 1 && std::abs(oy) <= 1 && std::abs(oz) <= 1;
+                peers.push_back({ adjacent ? (ox + 1) * 9 + (oy + 1) * 3 + (oz + 1) : 27, j });
+            }
+            std::sort(peers.begin(), peers.end());
+            for (const auto &p : peers) g_sim->ref.encounters.push_back(Encounter{ i, p.second });
+        }
+
+        // 3. Routing
+        g_sim->ref.reached.clear();
+        if (g_sim->routing_mode == 4) {
+            // Sends read the holdings of the start of routing; copies are stored
+            // afterwards by (receiver, seq, hops), one per receiver and message
+            std::vector<Delivery> inbox;
+            for (const Encounter &enc : g_sim->ref.encounters) {
+                for (int dir = 0; dir < 2; ++dir) {
+                    const uint32_t from = dir ? enc.b_idx : enc.a_idx;
+                    const uint32_t to = dir ? enc.a_idx : enc.b_idx;
+                    for (const RefCopy &c : g_sim->ref.agents[from].buffer) {
+                        if (ref_find(g_sim->ref.agents[to], c.msg.seq)) {
+                            g_sim->ref.stats.duplicate_offers++;
+                        } else {
+                            inbox.push_back(Delivery{ to, c.msg });
+                        }
+                    }
+                }
+            }
+            std::stable_sort(inbox.begin(), inbox.end(), [](const Delivery &x, const Delivery &y) {
+                if (x.to_idx != y.to_idx) return x.to_idx < y.to_idx;
+                if (x.msg.seq != y.msg.seq) return x.msg.seq < y.msg.seq;
+                return x.msg.hops < y.msg.hops;
+            });
+            for (size_t i = 0; i < inbox.size(); ++i) {
+                if (i > 0 && inbox[i - 1].to_idx == inbox[i].to_idx && inbox[i - 1].msg.seq == inbox[i].msg.seq) {
+                    g_sim->ref.stats.tx++;
+                    g_sim->ref.stats.rx++;
+                    g_sim->ref.stats.duplicates++;
+                    continue;
+                }
+                ref_transfer(inbox[i].to_idx, inbox[i].msg);
+            }
+        } else {
+            for (const Encounter &enc : g_sim->ref.encounters) {
+                ref_send(enc.a_idx, enc.b_idx);
+                ref_send(enc.b_idx, enc.a_idx);
+            }
+        }
+        ref_remove_copyless();
+
+        // 4. TTL: a message expires in the first step whose TTL_TICK tick reaches
+        // the tick holding created_at + ttl
+        const uint64_t now_tick = static_cast<uint64_t>(g_sim->ref.sim_time / TTL_TICK);
+        std::vector<uint32_t> expired;
+        for (const auto &entry : g_sim->ref.messages) {
+            const RefMessage &rm = entry.second;
+            if (rm.msg.ttl == 0) continue;
+            const double expires_at = rm.created_at + static_cast<double>(rm.msg.ttl);
+            if (static_cast<uint64_t>(std::ceil(expires_at / TTL_TICK)) <= now_tick) expired.push_back(entry.first);
+        }
+        for (uint32_t seq : expired) {
+            ref_purge(seq);
+            g_sim->ref.stats.expired++;
+        }
+
+        // 5. Delivery: messages whose destination holds a copy leave the system
+        for (uint32_t seq : g_sim->ref.reached) {
+            const auto it = g_sim->ref.messages.find(seq);
+            if (it == g_sim->ref.messages.end()) continue;
+            if (ref_find(g_sim->ref.agents[it->second.msg.dst - 1], seq)) ref_purge(seq);
+        }
+
+        ref_compare();
+    }
+#endif
 }
 
 // --- API Internals ---
@@ -81,128 +2378,188 @@ namespace {
 extern "C" {
 
 // --- API required stubs for WASM export ---
-void dtnsim_reset() {
-    g_nodes.clear();
-    g_agents.clear();
-    g_node_positions.clear();
-    g_agent_positions.clear();
-    g_messages.clear();
-    g_agent_delivered.clear();
-    g_node_count = 0;
-    g_agent_count = 0;
-    g_seq_counter = 0;
-    memset(&g_stats, 0, sizeof(g_stats));
-    g_routing_mode = 0;
+DtnSim* dtnsim_create() {
+    return new DtnSim();
 }
 
+void dtnsim_destroy(DtnSim* sim) {
+    if (!sim) return;
+    dtnsim_ctx_follow(sim, nullptr);
+    for (DtnSim *follower : sim->followers) follower->leader = nullptr;
+    delete sim;
+}
 
-// Use the NodePositionsBuffer typedef from dtnsim_api.h
-static NodePositionsBuffer g_node_positions_buf = {0, 0, 0, 12, 1, 0};
-static NodePositionsBuffer g_agent_positions_buf = {0, 0, 0, 12, 1, 0};
+void dtnsim_ctx_reset(DtnSim* sim) {
+    ContextScope scope(sim);
+    g_sim->graph.reset();
+    g_sim->agents.clear();
+    g_sim->agent_positions.clear();
+    g_sim->messages.clear();
+    g_sim->message_meta.clear();
+    g_sim->holder_pool.clear();
+    g_sim->message_pos.clear();
+    g_sim->expiry_wheel.clear();
+    g_sim->contacts.clear();
+    g_sim->contacts_prev.clear();
+    g_sim->agent_delivered.clear();
+    g_sim->node_count = 0;
+    g_sim->agent_count = 0;
+    g_sim->seq_counter = 0;
+    g_sim->sim_time = 0.0;
+    g_sim->step_index = 0;
+    g_sim->hotspots.clear();
+    g_sim->pending_injections.clear();
+    g_sim->injection_order = 0;
+    g_sim->reached_destination.clear();
+    g_sim->log = RoutingLog{};
+    g_sim->worker_logs.clear();
+    g_sim->copyless.clear();
+    g_sim->ensemble_held.clear();
+    g_sim->ensemble_before.clear();
+    memset(&g_sim->ensemble, 0, sizeof(g_sim->ensemble));
+    memset(&g_sim->stats, 0, sizeof(g_sim->stats));
+    memset(&g_sim->delivery_hist, 0, sizeof(g_sim->delivery_hist));
+    g_sim->routing_mode = 0;
+#ifdef DTNSIM_REFERENCE
+    g_sim->ref = ReferenceEngine{};
+    g_sim->divergence.clear();
+#endif
+}
 
-const NodePositionsBuffer* dtnsim_get_node_positions() {
+
+const NodePositionsBuffer* dtnsim_ctx_get_node_positions(DtnSim* sim) {
+    ContextScope scope(sim);
     // Fill metadata for JS
-    g_node_positions_buf.positions_ptr = (uint32_t)(reinterpret_cast<uintptr_t>(g_node_positions.data()));
-    g_node_positions_buf.ids_ptr = 0; // Not implemented
-    g_node_positions_buf.count = (uint32_t)g_node_count;
-    g_node_positions_buf.positions_stride = 12; // 3 floats (x,y,z) * 4 bytes
-    static uint32_t version = 1;
-    g_node_positions_buf.version = version++;
-    g_node_positions_buf.reserved = 0;
-    return &g_node_positions_buf;
+    g_sim->node_positions_buf.positions_ptr = g_sim->graph ? reinterpret_cast<uintptr_t>(g_sim->graph->positions.data()) : 0;
+    g_sim->node_positions_buf.ids_ptr = 0; // Not implemented
+    g_sim->node_positions_buf.count = (uint32_t)g_sim->node_count;
+    g_sim->node_positions_buf.positions_stride = 12; // 3 floats (x,y,z) * 4 bytes
+    g_sim->node_positions_buf.version = g_sim->node_positions_version++;
+    g_sim->node_positions_buf.reserved = 0;
+    return &g_sim->node_positions_buf;
 }
 
-const NodePositionsBuffer* dtnsim_get_agent_positions() {
-    g_agent_positions_buf.positions_ptr = (uint32_t)(reinterpret_cast<uintptr_t>(g_agent_positions.data()));
-    g_agent_positions_buf.ids_ptr = 0;
-    g_agent_positions_buf.count = (uint32_t)g_agent_count;
-    g_agent_positions_buf.positions_stride = 12;
-    static uint32_t version = 1;
-    g_agent_positions_buf.version = version++;
-    g_agent_positions_buf.reserved = 0;
-    return &g_agent_positions_buf;
+const NodePositionsBuffer* dtnsim_ctx_get_agent_positions(DtnSim* sim) {
+    ContextScope scope(sim);
+    g_sim->agent_positions_buf.positions_ptr = reinterpret_cast<uintptr_t>(g_sim->agent_positions.data());
+    g_sim->agent_positions_buf.ids_ptr = 0;
+    g_sim->agent_positions_buf.count = (uint32_t)g_sim->agent_count;
+    g_sim->agent_positions_buf.positions_stride = 12;
+    g_sim->agent_positions_buf.version = g_sim->agent_positions_version++;
+    g_sim->agent_positions_buf.reserved = 0;
+    return &g_sim->agent_positions_buf;
 }
 
-const RoutingStats* dtnsim_get_stats() {
-    return &g_stats;
+const RoutingStats* dtnsim_ctx_get_stats(DtnSim* sim) {
+    ContextScope scope(sim);
+    return &g_sim->stats;
 }
 
-const Message* dtnsim_get_message_list(uint32_t* out_count) {
-    if (out_count) *out_count = (uint32_t)g_messages.size();
-    return g_messages.data();
+const DeliveryHistograms* dtnsim_ctx_get_delivery_histograms(DtnSim* sim) {
+    ContextScope scope(sim);
+    return &g_sim->delivery_hist;
 }
 
-void dtnsim_init(uint32_t agent_count, const char* routing_name) {
-    dtnsim_reset();
+const StepProfile* dtnsim_ctx_get_profile(DtnSim* sim) {
+    ContextScope scope(sim);
+    return &g_sim->profile;
+}
+
+uint32_t dtnsim_ctx_set_perf_counters(DtnSim* sim, uint32_t enabled) {
+    ContextScope scope(sim);
+#ifdef DTNSIM_PROFILE
+    if (!enabled) {
+        g_sim->phase_counters.close();
+        return 0;
+    }
+    return g_sim->phase_counters.mask() ? g_sim->phase_counters.mask() : g_sim->phase_counters.open();
+#else
+    (void)enabled;
+    return 0;
+#endif
+}
+
+const AllocStats* dtnsim_ctx_get_alloc_stats(DtnSim* sim) {
+    ContextScope scope(sim);
+    return &g_sim->alloc_stats;
+}
+
+uint32_t dtnsim_write_trace(const char* path) {
+#ifdef DTNSIM_TRACE
+    if (!path) return 0;
+    FILE *f = fopen(path, "w");
+    if (!f) return 0;
+    const uint64_t head = g_trace_head.load(std::memory_order_acquire);
+    const uint64_t count = head < DTNSIM_TRACE_CAPACITY ? head : DTNSIM_TRACE_CAPACITY;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const uint32_t threads = g_trace_threads.load(std::memory_order_relaxed);
+    for (uint32_t t = 0; t < threads; ++t) {
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}},\n",
+                t, t == 0 ? "main" : "worker", t);
+    }
+    // Oldest first; timestamps in microseconds as the format expects
+    for (uint64_t i = head - count; i < head; ++i) {
+        const TraceEvent &e = g_trace_ring[i & (DTNSIM_TRACE_CAPACITY - 1)];
+        fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                e.name, e.tid, e.start_ns * 1e-3, e.dur_ns * 1e-3, i + 1 < head ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    const bool ok = fclose(f) == 0;
+    return ok ? static_cast<uint32_t>(count) : 0;
+#else
+    (void)path;
+    return 0;
+#endif
+}
+
+const Message* dtnsim_ctx_get_message_list(DtnSim* sim, uint32_t* out_count) {
+    ContextScope scope(sim);
+    if (out_count) *out_count = (uint32_t)g_sim->messages.size();
+    return g_sim->messages.data();
+}
+
+void dtnsim_ctx_init(DtnSim* sim, uint32_t agent_count, const char* routing_name) {
+    ContextScope scope(sim);
+    DTNSIM_TRACE_SCOPE(init_scope, "dtnsim_init");
+    DTNSIM_TRACE_SCOPE(phase, "graph");
+    // Held until the new graph is in place, so that consecutive seeded inits of this
+    // context on the same graph reuse it even when no other context holds it
+    const std::shared_ptr<const Graph> previous_graph = g_sim->graph;
+    dtnsim_ctx_reset(sim);
     // For now, use the same count for graph nodes and agents, but keep
     // them conceptually separate.
-    g_node_count = agent_count;
-    g_agent_count = agent_count;
-
-    g_nodes.clear();
-    g_nodes.reserve(g_node_count);
-    g_node_positions.clear();
-    g_node_positions.reserve(g_node_count * 3);
-
-    // Place graph nodes randomly in a 3D box (scaled up to ~1500x1500x1500 to lengthen edges)
-    for (uint32_t i = 0; i < g_node_count; ++i) {
-        GraphNode n;
-        n.x = static_cast<float>(rand()) / static_cast<float>(RAND_MAX) * 1500.0f;
-        n.y = static_cast<float>(rand()) / static_cast<float>(RAND_MAX) * 1500.0f;
-        n.z = static_cast<float>(rand()) / static_cast<float>(RAND_MAX) * 1500.0f;
-        g_nodes.push_back(n);
-        g_node_positions.push_back(n.x);
-        g_node_positions.push_back(n.y);
-        g_node_positions.push_back(n.z);
-    }
-
-    // Build explicit adjacency (k-nearest neighbors) on the static graph
-    if (g_node_count > 1) {
-        const uint32_t K = 3; // neighbors per node
-        for (uint32_t i = 0; i < g_node_count; ++i) {
-            struct DistIdx { float d2; uint32_t j; };
-            std::vector<DistIdx> dists;
-            dists.reserve(g_node_count - 1);
-            const GraphNode &ni = g_nodes[i];
-            for (uint32_t j = 0; j < g_node_count; ++j) {
-                if (j == i) continue;
-                const GraphNode &nj = g_nodes[j];
-                float dx = ni.x - nj.x;
-                float dy = ni.y - nj.y;
-                float dz = ni.z - nj.z;
-                float d2 = dx*dx + dy*dy + dz*dz;
-                dists.push_back({d2, j});
-            }
-            std::sort(dists.begin(), dists.end(), [](const DistIdx &a, const DistIdx &b){ return a.d2 < b.d2; });
-            const uint32_t limit = std::min<uint32_t>(K, (uint32_t)dists.size());
-            for (uint32_t k = 0; k < limit; ++k) {
-                uint32_t j = dists[k].j;
-                // add undirected edge i <-> j (avoid obvious duplicates)
-                if (std::find(g_nodes[i].neighbors.begin(), g_nodes[i].neighbors.end(), j) == g_nodes[i].neighbors.end()) {
-                    g_nodes[i].neighbors.push_back(j);
-                }
-                if (std::find(g_nodes[j].neighbors.begin(), g_nodes[j].neighbors.end(), i) == g_nodes[j].neighbors.end()) {
-                    g_nodes[j].neighbors.push_back(i);
-                }
-            }
-        }
+    g_sim->node_count = agent_count;
+    g_sim->agent_count = agent_count;
+
+    // Place graph nodes randomly in a 3D box (g_sim->world_size per side, ~1500 by default
+    // to lengthen edges) and link each with its nearest nodes. Seeded runs take the graph
+    // from the cache and then skip the generator past the node coordinates, so the
+    // agents draw the same numbers whether this init built the graph or not.
+    if (g_sim->seeded) {
+        g_sim->graph = shared_graph(g_sim->graph_seeded ? g_sim->graph_seed : g_sim->seed, g_sim->node_count);
+        g_sim->sim_rng.state = 0x452821e638d01377ull ^ g_sim->seed;
+        g_sim->sim_rng.state += 3ull * g_sim->node_count * SplitMix64::GAMMA;
+    } else {
+        g_sim->graph = build_graph(g_sim->node_count);
     }
+    const std::vector<GraphNode> &nodes = g_sim->graph->nodes;
 
     // Initialize agents on random graph nodes
-    g_agents.clear();
-    g_agents.reserve(g_agent_count);
-    g_agent_positions.clear();
-    g_agent_positions.reserve(g_agent_count * 3);
-    g_agent_delivered.clear();
-    g_agent_delivered.resize(g_agent_count, 0);
-
-    for (uint32_t i = 0; i < g_agent_count; ++i) {
+    DTNSIM_TRACE_NEXT(phase, "agents");
+    g_sim->agents.clear();
+    g_sim->agents.reserve(g_sim->agent_count);
+    g_sim->agent_positions.clear();
+    g_sim->agent_positions.reserve(g_sim->agent_count * 3);
+    g_sim->agent_delivered.clear();
+    g_sim->agent_delivered.resize(g_sim->agent_count, 0);
+
+    for (uint32_t i = 0; i < g_sim->agent_count; ++i) {
         Agent a;
         a.id = i + 1;
-        a.current_node = (g_node_count > 0) ? (rand() % g_node_count) : 0;
-        const GraphNode &start = g_nodes[a.current_node];
-        if (!g_nodes[a.current_node].neighbors.empty()) {
-            a.target_node = g_nodes[a.current_node].neighbors[rand() % g_nodes[a.current_node].neighbors.size()];
+        a.current_node = (g_sim->node_count > 0) ? (sim_rand() % g_sim->node_count) : 0;
+        const GraphNode &start = nodes[a.current_node];
+        if (!start.neighbors.empty()) {
+            a.target_node = start.neighbors[sim_rand() % start.neighbors.size()];
         } else {
             a.target_node = a.current_node;
         }
@@ -211,384 +2568,1198 @@ void dtnsim_init(uint32_t agent_count, const char* routing_name) {
         a.y = start.y;
         a.z = start.z;
         a.has_initial = false;
-        g_agents.push_back(a);
-        g_agent_positions.push_back(a.x);
-        g_agent_positions.push_back(a.y);
-        g_agent_positions.push_back(a.z);
+        a.drop_rng.state = 0x6a09e667f3bcc909ull ^ a.id ^ (static_cast<uint64_t>(g_sim->seed) << 32);
+        g_sim->agents.push_back(a);
+        g_sim->agent_positions.push_back(a.x);
+        g_sim->agent_positions.push_back(a.y);
+        g_sim->agent_positions.push_back(a.z);
     }
     // Select routing strategy by name
-    // Only "carryonly" and "epidemic" supported for now
-    // Store as int for fast check in step (0: CarryOnly, 1: Epidemic)
+    // "carryonly", "epidemic", "prophet", "maxprop", "epidemic_bsp" and "epidemic_ensemble"
+    // are supported
+    // Store as int for fast check in step (0: CarryOnly, 1: Epidemic, 2: PRoPHET, 3: MaxProp,
+    // 4: Epidemic (bulk-synchronous), 5: Epidemic ensemble)
     if (routing_name && strcmp(routing_name, "epidemic") == 0) {
-        g_routing_mode = 1;
+        g_sim->routing_mode = 1;
+    } else if (routing_name && strcmp(routing_name, "prophet") == 0) {
+        g_sim->routing_mode = 2;
+    } else if (routing_name && strcmp(routing_name, "maxprop") == 0) {
+        g_sim->routing_mode = 3;
+    } else if (routing_name && strcmp(routing_name, "epidemic_bsp") == 0) {
+        g_sim->routing_mode = 4;
+    } else if (routing_name && strcmp(routing_name, "epidemic_ensemble") == 0) {
+        g_sim->routing_mode = 5;
     } else {
-        g_routing_mode = 0;
+        g_sim->routing_mode = 0;
     }
-    // Inject a single message (TTL effectively infinite; ttl field is unused)
+    // Inject a single message (expires after the configured default TTL; 0 = never)
     if (agent_count >= 2) {
-        uint32_t src = rand() % agent_count;
-        uint32_t dst = (src + 1 + rand() % (agent_count - 1)) % agent_count;
-        Message m;
-        m.src = g_agents[src].id;
-        m.dst = g_agents[dst].id;
-        m.seq = ++g_seq_counter;
-        m.ttl = 0; // 0 means "no expiry" in current logic
-        m.hops = 0;
-        g_agents[src].messages.push_back(m);
-        g_messages.push_back(m);
+        uint32_t src = sim_rand() % agent_count;
+        uint32_t dst = (src + 1 + sim_rand() % (agent_count - 1)) % agent_count;
+        if (g_sim->routing_mode == 5) {
+            // Ensemble runs carry replica masks instead; replica 0 stands for this message
+            start_ensemble(src);
+            src = g_sim->ensemble.sources[0];
+        } else {
+            create_message(src, dst, g_sim->default_ttl, g_sim->default_message_size, g_sim->sim_time);
+        }
         // Initial carrier has already "received" the initial message
-        g_agents[src].has_initial = true;
-        if (src < g_agent_delivered.size()) {
-            g_agent_delivered[src] = 1;
+        g_sim->agents[src].has_initial = true;
+        if (src < g_sim->agent_delivered.size()) {
+            g_sim->agent_delivered[src] = 1;
         }
     }
     // Reset stats
-    memset(&g_stats, 0, sizeof(g_stats));
+    memset(&g_sim->stats, 0, sizeof(g_sim->stats));
+    memset(&g_sim->delivery_hist, 0, sizeof(g_sim->delivery_hist));
     // delivered now means: number of distinct agents that have ever received the initial message
     if (agent_count >= 2) {
-        g_stats.delivered = 1; // initial carrier
+        g_sim->stats.delivered = 1; // initial carrier
+        if (find_message_pos(1) >= 0) g_sim->stats.created = 1; // ensemble runs create no message
     }
+    // Traffic is reproducible per agent count and seed, independently of mobility
+    g_sim->traffic_rng.state = 0x243f6a8885a308d3ull ^ agent_count ^ (static_cast<uint64_t>(g_sim->seed) << 32);
+    reserve_run_storage();
+    // Following needs matching agent counts: an init that breaks the match detaches
+    if (sim->leader && sim->leader->agent_count != sim->agent_count) dtnsim_ctx_follow(sim, nullptr);
+    for (size_t f = sim->followers.size(); f-- > 0;) {
+        if (sim->followers[f]->agent_count != sim->agent_count) dtnsim_ctx_follow(sim->followers[f], nullptr);
+    }
+#ifdef DTNSIM_REFERENCE
+    ref_start();
+#endif
 }
 
 // Expose per-agent delivered flags (0 = never received initial message, 1 = has received)
-const uint8_t* dtnsim_get_agent_delivered_flags() {
-    if (g_agent_delivered.empty()) return nullptr;
-    return g_agent_delivered.data();
+const uint8_t* dtnsim_ctx_get_agent_delivered_flags(DtnSim* sim) {
+    ContextScope scope(sim);
+    if (g_sim->agent_delivered.empty()) return nullptr;
+    return g_sim->agent_delivered.data();
 }
 
-void dtnsim_step(double dt) {
-    const uint32_t agent_count = g_agent_count;
+namespace {
+// One step of g_sim. A follower takes the agent movement of its leader's step, which
+// has just run, and routes over the leader's encounter list instead of finding its own.
+void step_context(double dt) {
+    DtnSim *const sim = g_sim;
+    const DtnSim *const leader = g_sim->leader;
+    const uint32_t agent_count = g_sim->agent_count;
     if (agent_count == 0) return;
+    DTNSIM_TRACE_SCOPE(step_scope, "dtnsim_step");
+    DTNSIM_TRACE_SCOPE(phase, "traffic");
 
     const float fdt = static_cast<float>(dt);
+    g_sim->sim_time += dt;
+    ++g_sim->step_index;
+
+#ifdef DTNSIM_PROFILE
+    g_sim->profile = StepProfile{};
+    g_sim->profile.enabled = 1;
+    g_sim->profile.step = g_sim->step_index;
+    g_sim->profile_tx_before = g_sim->stats.tx;
+    g_sim->profile_allocs_before = g_alloc_count.load(std::memory_order_relaxed);
+    g_sim->phase_counters.start();
+    g_sim->phase_clock.start();
+#endif
+#ifdef DTNSIM_ALLOC_TRACKING
+    g_sim->alloc_count_before = g_alloc_count.load(std::memory_order_relaxed);
+    g_sim->alloc_bytes_before = g_alloc_bytes.load(std::memory_order_relaxed);
+#endif
+
+    // 0. Traffic
+    // Injections whose time has come, then the Poisson generator: the agents' arrival
+    // processes are merged into one of rate agent_count * rate, and each arrival picks
+    // its source uniformly, so the cost is proportional to the messages created.
+    while (!g_sim->pending_injections.empty() &&
+           g_sim->pending_injections.front().rec.at_ms * 1e-3 <= g_sim->sim_time) {
+        std::pop_heap(g_sim->pending_injections.begin(), g_sim->pending_injections.end(), injection_after);
+        const MessageInjection rec = g_sim->pending_injections.back().rec;
+        g_sim->pending_injections.pop_back();
+        inject_now(rec, rec.at_ms * 1e-3);
+    }
+    if (g_sim->traffic_rate > 0.0 && agent_count >= 2) {
+        if (g_sim->hotspot_count > 0) select_hotspots();
+        const uint32_t arrivals = sample_poisson(g_sim->traffic_rng, g_sim->traffic_rate * agent_count * dt);
+        for (uint32_t k = 0; k < arrivals; ++k) {
+            const uint32_t src = g_sim->traffic_rng.below(agent_count);
+            uint32_t dst = (src + 1 + g_sim->traffic_rng.below(agent_count - 1)) % agent_count;
+            if (!g_sim->hotspots.empty() && g_sim->traffic_rng.uniform() < g_sim->hotspot_fraction) {
+                const uint32_t h = g_sim->hotspots[g_sim->traffic_rng.below(static_cast<uint32_t>(g_sim->hotspots.size()))];
+                if (h != src) dst = h;
+            }
+            create_message(src, dst, g_sim->default_ttl, g_sim->default_message_size, g_sim->sim_time);
+        }
+    }
+
+    DTNSIM_PROFILE_LAP(traffic_ms);
+    DTNSIM_TRACE_NEXT(phase, "mobility");
 
     // 1. Agent mobility update (random walk on graph edges)
-    for (uint32_t i = 0; i < agent_count; ++i) {
-        Agent &a = g_agents[i];
-        if (g_node_count == 0) continue;
-        const GraphNode &src = g_nodes[a.current_node];
-        const GraphNode &dst = g_nodes[a.target_node];
-        float dx = dst.x - src.x;
-        float dy = dst.y - src.y;
-        float dz = dst.z - src.z;
-        float len = std::sqrt(dx*dx + dy*dy + dz*dz);
-
-        if (len < 1e-3f) {
-            a.progress = 1.0f;
-        } else {
-            float delta = (AGENT_SPEED * fdt) / len;
-            a.progress += delta;
-            if (a.progress > 1.0f) a.progress = 1.0f;
-        }
-
-        float t = a.progress;
-        a.x = src.x + dx * t;
-        a.y = src.y + dy * t;
-        a.z = src.z + dz * t;
-
-        // Write back to agent position buffer
-        const size_t base = static_cast<size_t>(i) * 3;
-        if (base + 2 < g_agent_positions.size()) {
-            g_agent_positions[base + 0] = a.x;
-            g_agent_positions[base + 1] = a.y;
-            g_agent_positions[base + 2] = a.z;
-        }
-
-        if (a.progress >= 1.0f) {
-            a.current_node = a.target_node;
-            const GraphNode &cur = g_nodes[a.current_node];
-            if (!cur.neighbors.empty()) {
-                a.target_node = cur.neighbors[rand() % cur.neighbors.size()];
-                a.progress = 0.0f;
-            }
-        }
-    }
-
-    // 2. Neighbor / encounter detection using a 3D uniform grid (on agent positions)
-    std::unordered_map<GridCellKey, std::vector<uint32_t>, GridCellKeyHash> grid;
-    grid.reserve(agent_count * 2);
-    for (uint32_t i = 0; i < agent_count; ++i) {
-        const Agent &a = g_agents[i];
-        GridCellKey key = cell_for(a);
-        grid[key].push_back(i);
-    }
-
-    std::vector<Encounter> encounters;
-    encounters.reserve(agent_count * 4);
-
-    const float comm_range2 = COMM_RANGE * COMM_RANGE;
-
-    for (uint32_t i = 0; i < agent_count; ++i) {
-        const Agent &ai = g_agents[i];
-        GridCellKey ci = cell_for(ai);
-        for (int dx = -1; dx <= 1; ++dx) {
-            for (int dy = -1; dy <= 1; ++dy) {
-                for (int dz = -1; dz <= 1; ++dz) {
-                    GridCellKey ck{ci.gx + dx, ci.gy + dy, ci.gz + dz};
-                    auto it = grid.find(ck);
-                    if (it == grid.end()) continue;
-                    const std::vector<uint32_t> &indices = it->second;
-                    for (uint32_t idx : indices) {
-                        if (idx <= i) continue; // ensure each pair at most once per step
-                        const Agent &aj = g_agents[idx];
-                        const float dxp = ai.x - aj.x;
-                        const float dyp = ai.y - aj.y;
-                        const float dzp = ai.z - aj.z;
-                        const float dist2 = dxp*dxp + dyp*dyp + dzp*dzp;
-                        if (dist2 <= comm_range2) {
-                            encounters.push_back({ i, idx });
+    if (leader) {
+        // Follower: the leader has moved the agents and found the encounters
+        for (uint32_t i = 0; i < agent_count; ++i) {
+            Agent &a = g_sim->agents[i];
+            const Agent &l = leader->agents[i];
+            a.current_node = l.current_node;
+            a.target_node = l.target_node;
+            a.progress = l.progress;
+            a.x = l.x;
+            a.y = l.y;
+            a.z = l.z;
+        }
+        g_sim->agent_positions = leader->agent_positions;
+        DTNSIM_PROFILE_LAP(mobility_ms);
+        DTNSIM_PROFILE_LAP(grid_ms); // no grid of its own; keeps the phase sequence of every step
+    } else {
+        const GraphNode *nodes = g_sim->graph->nodes.data();
+        for (uint32_t i = 0; i < agent_count; ++i) {
+            Agent &a = g_sim->agents[i];
+            if (g_sim->node_count == 0) continue;
+            const GraphNode &src = nodes[a.current_node];
+            const GraphNode &dst = nodes[a.target_node];
+            float dx = dst.x - src.x;
+            float dy = dst.y - src.y;
+            float dz = dst.z - src.z;
+            float len = std::sqrt(dx*dx + dy*dy + dz*dz);
+
+            if (len < 1e-3f) {
+                a.progress = 1.0f;
+            } else {
+                float delta = (AGENT_SPEED * fdt) / len;
+                a.progress += delta;
+                if (a.progress > 1.0f) a.progress = 1.0f;
+            }
+
+            float t = a.progress;
+            a.x = src.x + dx * t;
+            a.y = src.y + dy * t;
+            a.z = src.z + dz * t;
+
+            // Write back to agent position buffer
+            const size_t base = static_cast<size_t>(i) * 3;
+            if (base + 2 < g_sim->agent_positions.size()) {
+                g_sim->agent_positions[base + 0] = a.x;
+                g_sim->agent_positions[base + 1] = a.y;
+                g_sim->agent_positions[base + 2] = a.z;
+            }
+
+            if (a.progress >= 1.0f) {
+                a.current_node = a.target_node;
+                const GraphNode &cur = nodes[a.current_node];
+                if (!cur.neighbors.empty()) {
+                    a.target_node = cur.neighbors[sim_rand() % cur.neighbors.size()];
+                    a.progress = 0.0f;
+                }
+            }
+        }
+
+        DTNSIM_PROFILE_LAP(mobility_ms);
+        DTNSIM_TRACE_NEXT(phase, "grid");
+
+        // 2. Neighbor / encounter detection using a 3D uniform grid (on agent positions)
+        // Agents are bucketed by cell with a counting sort: count per cell, hand out
+        // spans, then place agents in index order, so each cell lists them ascending.
+        OpenMap<CellSpan, uint64_t> &cells = g_sim->scratch.cells;
+        std::vector<uint32_t> &cell_agents = g_sim->scratch.cell_agents;
+        cells.clear();
+        for (uint32_t i = 0; i < agent_count; ++i) {
+            cells.insert(cell_code(cell_for(g_sim->agents[i])), CellSpan{ 0, 0 }).end++;
+        }
+        uint32_t cell_offset = 0;
+        cells.for_each([&](uint64_t, CellSpan &span) {
+            const uint32_t count = span.end;
+            span.begin = span.end = cell_offset;
+            cell_offset += count;
+        });
+        cell_agents.resize(agent_count);
+        for (uint32_t i = 0; i < agent_count; ++i) {
+            cell_agents[cells.find(cell_code(cell_for(g_sim->agents[i])))->end++] = i;
+        }
+
+        DTNSIM_PROFILE_LAP(grid_ms);
+        DTNSIM_TRACE_NEXT(phase, "pairs");
+
+        std::vector<Encounter> &found = g_sim->scratch.encounters;
+        found.clear();
+
+        const float comm_range2 = COMM_RANGE * COMM_RANGE;
+
+        for (uint32_t i = 0; i < agent_count; ++i) {
+            const Agent &ai = g_sim->agents[i];
+            GridCellKey ci = cell_for(ai);
+            for (int dx = -1; dx <= 1; ++dx) {
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dz = -1; dz <= 1; ++dz) {
+                        GridCellKey ck{ci.gx + dx, ci.gy + dy, ci.gz + dz};
+                        const CellSpan *span = cells.find(cell_code(ck));
+                        if (!span) continue;
+                        DTNSIM_PROFILE_COUNT(cells_visited, 1);
+                        for (uint32_t k = span->begin; k < span->end; ++k) {
+                            const uint32_t idx = cell_agents[k];
+                            if (idx <= i) continue; // ensure each pair at most once per step
+                            DTNSIM_PROFILE_COUNT(pair_tests, 1);
+                            const Agent &aj = g_sim->agents[idx];
+                            const float dxp = ai.x - aj.x;
+                            const float dyp = ai.y - aj.y;
+                            const float dzp = ai.z - aj.z;
+                            const float dist2 = dxp*dxp + dyp*dyp + dzp*dzp;
+                            if (dist2 <= comm_range2) {
+                                found.push_back({ i, idx });
+                            }
                         }
                     }
                 }
             }
         }
+
+        DTNSIM_PROFILE_COUNT(encounters, found.size());
     }
+    const std::vector<Encounter> &encounters = leader ? leader->scratch.encounters : g_sim->scratch.encounters;
+
+    DTNSIM_PROFILE_LAP(pairs_ms);
+    DTNSIM_TRACE_NEXT(phase, "routing");
 
     // 3. Routing and message forwarding
     // We must obey:
     //  - each message may be transferred at most once per encounter
     //  - a newly received message cannot be forwarded again within the same step
+    // In immunity mode the peers of an encounter first exchange anti-packets, so
+    // copies of messages known to be delivered are gone before anything is forwarded.
+    if (g_sim->immunity && g_sim->routing_mode == 4) {
+        spread_immunity(encounters);
+    }
 
-    // Track which (agent, message) pairs received a message in this step
-    std::unordered_set<uint64_t> received_this_step;
-    received_this_step.reserve(1024);
-
-    auto make_key = [](uint32_t agent_idx, uint32_t msg_idx) -> uint64_t {
-        return (static_cast<uint64_t>(agent_idx) << 32) | static_cast<uint64_t>(msg_idx);
+    // A held copy records the step it arrived in, which tells whether its holder
+    // received it in this step
+    auto received_now = [](uint32_t agent_idx, const Message &m) {
+        return g_sim->agents[agent_idx].buffer.arrival_step(m.seq) == g_sim->step_index;
     };
 
-    // Helper: find message index in global g_messages by (src,dst,seq)
-    auto find_global_msg_index = [](const Message &m) -> int {
-        for (size_t i = 0; i < g_messages.size(); ++i) {
-            const Message &gm = g_messages[i];
-            if (gm.src == m.src && gm.dst == m.dst && gm.seq == m.seq) return static_cast<int>(i);
-        }
-        return -1;
-    };
+    // A message the policy would send but the peer already holds is counted in
+    // duplicate_offers. The holdings check comes first since it is the common
+    // reason to skip a message; the policy's own checks only run on that path to
+    // tell whether the skipped message would have been offered at all.
 
     // Helper: mark that an agent has received the initial message (seq == 1) at least once
-    auto mark_initial_received = [&](uint32_t agent_idx) {
-        if (agent_idx >= g_agents.size()) return;
-        Agent &ag = g_agents[agent_idx];
+    auto mark_initial_received = [](uint32_t agent_idx, RoutingLog &log) {
+        if (agent_idx >= g_sim->agents.size()) return;
+        Agent &ag = g_sim->agents[agent_idx];
         if (!ag.has_initial) {
             ag.has_initial = true;
-            if (agent_idx < g_agent_delivered.size()) {
-                g_agent_delivered[agent_idx] = 1;
+            if (agent_idx < g_sim->agent_delivered.size()) {
+                g_sim->agent_delivered[agent_idx] = 1;
+            }
+            log.stats.delivered++; // count distinct agents that have ever held the initial message
+        }
+    };
+
+    // Helper: replicate m into the receiver's buffer (one hop further than the
+    // sender's copy) and account for the transfer
+    auto transfer = [&](uint32_t to_idx, const Message &m, RoutingLog &log) {
+        Message copy = m;
+        copy.hops++;
+        store_copy(to_idx, copy, g_sim->step_index, log);
+        if (g_sim->agents[to_idx].id == m.dst) {
+            log.reached.push_back(m.seq);
+        }
+        log.stats.tx++;
+        log.stats.rx++;
+        if (m.seq == 1) {
+            mark_initial_received(to_idx, log);
+        }
+    };
+
+    // Bandwidth: with a link rate configured each contact direction carries at most
+    // g_sim->link_rate * dt bytes per step. A message that does not fit stays in flight in
+    // the contact's state and resumes on the next step if the pair is still in range;
+    // contacts that break lose their partial transfers.
+    g_sim->contacts_prev.swap(g_sim->contacts);
+    g_sim->contacts.clear();
+    const bool link_limited = g_sim->link_rate > 0.0;
+    const double step_budget = g_sim->link_rate * dt;
+
+    struct Link {
+        LinkDirection *state; // nullptr when bandwidth is unlimited
+        double budget;        // bytes this direction may still carry in this step
+    };
+
+    // Helper: push m over a link, calling deliver() once its last byte has arrived.
+    // Returns false once the link's budget for this step is used up.
+    auto offer = [](Link &link, const Message &m, auto &&deliver) -> bool {
+        if (!link.state) {
+            deliver();
+            return true;
+        }
+        if (link.budget <= 0.0) return false;
+        LinkDirection &ld = *link.state;
+        const double done = (ld.seq == m.seq) ? ld.bytes_done : 0.0;
+        const double need = static_cast<double>(m.size) - done;
+        if (link.budget >= need) {
+            link.budget -= need;
+            ld = LinkDirection{0, 0.0};
+            deliver();
+            return link.budget > 0.0;
+        }
+        ld.seq = m.seq;
+        ld.bytes_done = done + link.budget;
+        link.budget = 0.0;
+        return false;
+    };
+
+    // Helper: give the message left in flight on a link the first claim on this
+    // step's budget, as long as the sender still holds it. If the receiver got it
+    // from another peer in the meantime, the part already sent arrived as a duplicate
+    // and the transfer is dropped.
+    auto resume = [](Link &link, const Agent &from, const Agent &to, RoutingLog &log, auto &&send) {
+        if (!link.state || link.state->seq == 0) return;
+        const Message *m = from.buffer.find(link.state->seq);
+        if (m && holds(to, m->seq)) {
+            log.stats.duplicates++;
+            m = nullptr;
+        }
+        if (m) {
+            send(*m);
+        } else {
+            *link.state = LinkDirection{0, 0.0};
+        }
+    };
+
+    // PRoPHET: forward from -> to every message `to` lacks, if `to` is the destination
+    // or has a strictly higher delivery predictability for it (GRTR strategy).
+    const double now = g_sim->sim_time;
+    auto prophet_forward = [&](uint32_t from_idx, uint32_t to_idx, Link &link, RoutingLog &log) {
+        Agent &from = g_sim->agents[from_idx];
+        Agent &to = g_sim->agents[to_idx];
+        auto eligible = [&](const Message &m) {
+            if (received_now(from_idx, m)) return false;
+            if (to.id == m.dst) return true;
+            const uint32_t dst_idx = m.dst - 1;
+            return prophet_get(to, dst_idx, now) > prophet_get(from, dst_idx, now);
+        };
+        auto send = [&](const Message &m) -> bool {
+            if (holds(to, m.seq)) {
+                if (eligible(m)) log.stats.duplicate_offers++;
+                return true;
+            }
+            if (!eligible(m)) return true;
+            return offer(link, m, [&] { transfer(to_idx, m, log); });
+        };
+        resume(link, from, to, log, send);
+        from.buffer.for_each_while(send);
+    };
+
+    // MaxProp: hand over messages destined to the peer first, then replicate the
+    // remaining messages the peer lacks in the sender's queue order.
+    auto maxprop_forward = [&](uint32_t from_idx, uint32_t to_idx, Link &link, RoutingLog &log) {
+        Agent &from = g_sim->agents[from_idx];
+        Agent &to = g_sim->agents[to_idx];
+        bool more = true;
+        auto send = [&](const Message &m) -> bool {
+            if (holds(to, m.seq)) {
+                if (!received_now(from_idx, m)) log.stats.duplicate_offers++;
+                return true;
             }
-            g_stats.delivered++; // count distinct agents that have ever held the initial message
+            if (received_now(from_idx, m)) return true;
+            more = offer(link, m, [&] { transfer(to_idx, m, log); });
+            return more;
+        };
+        resume(link, from, to, log, send);
+        if (more) {
+            from.buffer.for_each_while([&](const Message &m) {
+                return m.dst == to.id ? send(m) : true;
+            });
+        }
+        if (more) {
+            from.maxprop_queue.for_each_ordered([&](const Message &m) {
+                return m.dst != to.id ? send(m) : true;
+            });
         }
     };
 
-    for (const Encounter &enc : encounters) {
-        Agent &a = g_agents[enc.a_idx];
-        Agent &b = g_agents[enc.b_idx];
+    // One encounter. Everything it changes belongs to its two agents or its contact
+    // state, except for the effects recorded in log.
+    auto route_encounter = [&](const Encounter &enc, ContactState *cs, RoutingLog &log) {
+        Agent &a = g_sim->agents[enc.a_idx];
+        Agent &b = g_sim->agents[enc.b_idx];
+
+        Link ab{nullptr, 0.0};
+        Link ba{nullptr, 0.0};
+        if (cs) {
+            ab = Link{ &cs->dir[0], step_budget };
+            ba = Link{ &cs->dir[1], step_budget };
+        }
+
+        if (g_sim->immunity) {
+            exchange_immunity(enc.a_idx, enc.b_idx, log);
+        }
 
-        if (g_routing_mode == 0) {
+        if (g_sim->routing_mode == 0) {
             // CarryOnly
             // An agent forwards a message only if it encounters the destination directly.
             // Forwarding to intermediates is not allowed.
             // Each successful delivery: tx++, rx++, delivered++, message removed from system.
+            // The destination stores the copy like any receiver, so the delivery check
+            // below removes the message at the end of the step and it is handed over
+            // only once, however long the contact lasts.
 
             // From a -> b
-            for (const Message &m : a.messages) {
-                if (b.id != m.dst) continue;
+            auto send_ab = [&](const Message &m) -> bool {
+                if (b.id != m.dst) return true;
                 // destination reached
                 // Check duplicates: if b already holds m, count duplicate and skip
-                bool b_has = false;
-                for (const Message &bm : b.messages) {
-                    if (bm.src==m.src && bm.dst==m.dst && bm.seq==m.seq) { b_has = true; break; }
+                if (holds(b, m.seq)) {
+                    log.stats.duplicate_offers++;
+                    return true;
                 }
-                if (b_has) {
-                    continue;
-                }
-                g_stats.tx++;
-                g_stats.rx++;
-                // Conceptual delivery: destination receives the message once
-                if (m.seq == 1) {
-                    mark_initial_received(enc.b_idx);
-                }
-
-                // Remove from all agents and global list after loop (delivery/removal handled below)
-            }
+                return offer(ab, m, [&] { transfer(enc.b_idx, m, log); });
+            };
+            resume(ab, a, b, log, send_ab);
+            a.buffer.for_each_while(send_ab);
 
             // From b -> a (symmetric case)
-            for (const Message &m : b.messages) {
-                if (a.id != m.dst) continue;
-                bool a_has = false;
-                for (const Message &am : a.messages) {
-                    if (am.src==m.src && am.dst==m.dst && am.seq==m.seq) { a_has = true; break; }
-                }
-                if (a_has) {
-                    continue;
+            auto send_ba = [&](const Message &m) -> bool {
+                if (a.id != m.dst) return true;
+                if (holds(a, m.seq)) {
+                    log.stats.duplicate_offers++;
+                    return true;
                 }
-                g_stats.tx++;
-                g_stats.rx++;
-                if (m.seq == 1) {
-                    mark_initial_received(enc.a_idx);
-                }
-            }
-        } else {
+                return offer(ba, m, [&] { transfer(enc.a_idx, m, log); });
+            };
+            resume(ba, b, a, log, send_ba);
+            b.buffer.for_each_while(send_ba);
+        } else if (g_sim->routing_mode == 1) {
             // Epidemic routing
             // During an encounter:
             //  - each side forwards all messages it holds and the neighbor does not hold
+            //    (as far as the link's budget allows)
             //  - each message at most once per encounter
             //  - messages received in this step cannot be forwarded again in this step
 
-            // Build fast membership sets for b and a for this encounter
-            auto has_msg = [](const std::vector<Message> &vec, const Message &m) {
-                for (const Message &x : vec) {
-                    if (x.src==m.src && x.dst==m.dst && x.seq==m.seq) return true;
+            // a -> b
+            auto send_ab = [&](const Message &m) -> bool {
+                if (holds(b, m.seq)) {
+                    if (!received_now(enc.a_idx, m)) log.stats.duplicate_offers++;
+                    return true;
                 }
-                return false;
+                if (received_now(enc.a_idx, m)) return true; // newly received earlier this step
+                return offer(ab, m, [&] { transfer(enc.b_idx, m, log); });
             };
+            resume(ab, a, b, log, send_ab);
+            a.buffer.for_each_while(send_ab);
 
-            // a -> b
-            for (size_t mi = 0; mi < a.messages.size(); ++mi) {
-                const Message &m = a.messages[mi];
-                int gidx = find_global_msg_index(m);
-                if (gidx < 0) continue;
-                uint64_t key = make_key(enc.a_idx, static_cast<uint32_t>(gidx));
-                if (received_this_step.find(key) != received_this_step.end()) continue; // newly received earlier this step
-
-                if (has_msg(b.messages, m)) {
-                    continue;
+            // b -> a
+            auto send_ba = [&](const Message &m) -> bool {
+                if (holds(a, m.seq)) {
+                    if (!received_now(enc.b_idx, m)) log.stats.duplicate_offers++;
+                    return true;
                 }
-
-                // Transfer
-                b.messages.push_back(m);
-                g_stats.tx++;
-                g_stats.rx++;
-
-                // Track spread of the initial message (seq == 1)
-                if (m.seq == 1) {
-                    mark_initial_received(enc.b_idx);
+                if (received_now(enc.b_idx, m)) return true;
+                return offer(ba, m, [&] { transfer(enc.a_idx, m, log); });
+            };
+            resume(ba, b, a, log, send_ba);
+            b.buffer.for_each_while(send_ba);
+        } else if (g_sim->routing_mode == 2) {
+            // PRoPHET routing
+            // Predictability tables are only updated when a contact starts (the pair was
+            // not in range during the previous step); a contact lasting several steps
+            // counts as one encounter. Forwarding is evaluated on every step in range.
+            // Either entry may have aged out during the contact (prophet_get erases it),
+            // which restarts the contact and recreates both.
+            auto in_contact = [&](const ProphetEntry *pe) {
+                return pe && pe->last_contact_step != UINT32_MAX && pe->last_contact_step + 1 == g_sim->step_index;
+            };
+            const bool contact_start = !in_contact(a.prophet.find(enc.b_idx)) || !in_contact(b.prophet.find(enc.a_idx));
+            if (contact_start) {
+                prophet_reinforce(a, enc.b_idx, PROPHET_P_INIT, now);
+                prophet_reinforce(b, enc.a_idx, PROPHET_P_INIT, now);
+                const float p_ab = prophet_get(a, enc.b_idx, now);
+                const float p_ba = prophet_get(b, enc.a_idx, now);
+
+                // Transitive updates are computed from both peers' tables before any
+                // of them is applied, so the result does not depend on peer order.
+                std::vector<ProphetUpdate> &prophet_updates = log.prophet_updates;
+                prophet_updates.clear();
+                auto collect = [&](Agent &peer, uint32_t owner_idx, float p_owner_peer) {
+                    peer.prophet.for_each([&](uint32_t c, ProphetEntry &e) {
+                        if (c == owner_idx) return;
+                        // Age in place (no erase while iterating)
+                        if (now > e.updated_at) {
+                            const double k = (now - e.updated_at) / PROPHET_AGING_UNIT;
+                            e.p *= static_cast<float>(std::pow(static_cast<double>(PROPHET_GAMMA), k));
+                            e.updated_at = now;
+                        }
+                        if (e.p < PROPHET_P_MIN) return;
+                        prophet_updates.push_back({ owner_idx, c, p_owner_peer * e.p * PROPHET_BETA });
+                    });
+                };
+                collect(b, enc.a_idx, p_ab);
+                collect(a, enc.b_idx, p_ba);
+                for (const ProphetUpdate &u : prophet_updates) {
+                    prophet_reinforce(g_sim->agents[u.owner_idx], u.dst_idx, u.gain, now);
                 }
+            }
+            a.prophet.insert(enc.b_idx, ProphetEntry{0.0f, now, UINT32_MAX}).last_contact_step = g_sim->step_index;
+            b.prophet.insert(enc.a_idx, ProphetEntry{0.0f, now, UINT32_MAX}).last_contact_step = g_sim->step_index;
 
-                // Once per encounter: don't transfer same message again in this encounter from a->b
-                // (loop naturally ensures that)
-
-                // mark as received this step so b cannot forward it again this step
-                received_this_step.insert(make_key(enc.b_idx, static_cast<uint32_t>(gidx)));
+            prophet_forward(enc.a_idx, enc.b_idx, ab, log);
+            prophet_forward(enc.b_idx, enc.a_idx, ba, log);
+        } else {
+            // MaxProp routing
+            // On contact start both peers count the meeting; copies destined to the peer
+            // are the only queue entries whose estimated cost changed, so only they are
+            // re-keyed. Forwarding is evaluated on every step in range.
+            const MaxPropMeeting *mp = a.maxprop_meetings.find(enc.b_idx);
+            const bool contact_start = !(mp && mp->last_contact_step != UINT32_MAX &&
+                                         mp->last_contact_step + 1 == g_sim->step_index);
+            a.maxprop_meetings.insert(enc.b_idx, MaxPropMeeting{0, UINT32_MAX}).last_contact_step = g_sim->step_index;
+            b.maxprop_meetings.insert(enc.a_idx, MaxPropMeeting{0, UINT32_MAX}).last_contact_step = g_sim->step_index;
+            if (contact_start) {
+                a.maxprop_meetings.find(enc.b_idx)->count++;
+                b.maxprop_meetings.find(enc.a_idx)->count++;
+                a.buffer.for_each([&](const Message &m) {
+                    if (m.dst == b.id) a.maxprop_queue.push(m, maxprop_direct_meeting_key(a, m));
+                });
+                b.buffer.for_each([&](const Message &m) {
+                    if (m.dst == a.id) b.maxprop_queue.push(m, maxprop_direct_meeting_key(b, m));
+                });
             }
 
-            // b -> a
-            for (size_t mi = 0; mi < b.messages.size(); ++mi) {
-                const Message &m = b.messages[mi];
-                int gidx = find_global_msg_index(m);
-                if (gidx < 0) continue;
-                uint64_t key = make_key(enc.b_idx, static_cast<uint32_t>(gidx));
-                if (received_this_step.find(key) != received_this_step.end()) continue;
-
-                if (has_msg(a.messages, m)) {
-                    continue;
-                }
+            maxprop_forward(enc.a_idx, enc.b_idx, ab, log);
+            maxprop_forward(enc.b_idx, enc.a_idx, ba, log);
+        }
+    };
 
-                a.messages.push_back(m);
-                g_stats.tx++;
-                g_stats.rx++;
-                if (m.seq == 1) {
-                    mark_initial_received(enc.a_idx);
-                }
-                received_this_step.insert(make_key(enc.a_idx, static_cast<uint32_t>(gidx)));
-            }
+    const uint32_t encounter_count = static_cast<uint32_t>(encounters.size());
+
+    // Contact states are created up front (in list order) so that routing only
+    // touches existing entries
+    std::vector<ContactState*> &contact_of = g_sim->scratch.contact_of;
+    contact_of.assign(encounter_count, nullptr);
+    if (link_limited) {
+        for (const Encounter &enc : encounters) {
+            const uint64_t key = (static_cast<uint64_t>(enc.a_idx) << 32) | enc.b_idx;
+            const ContactState *prev = g_sim->contacts_prev.find(key);
+            g_sim->contacts.insert(key, prev ? *prev : ContactState{});
+        }
+        for (uint32_t e = 0; e < encounter_count; ++e) {
+            const uint64_t key = (static_cast<uint64_t>(encounters[e].a_idx) << 32) | encounters[e].b_idx;
+            contact_of[e] = g_sim->contacts.find(key);
         }
     }
 
-    // 4. TTL handling (disabled for infinite TTL) & 5. Delivery check and message removal
-    // We maintain g_messages as the set of all active (non-delivered) messages.
-    // Agents hold references (by value). With infinite TTL we:
-    //  - do NOT decrement ttl or drop by expiry
-    //  - only remove messages that reached destination from all agents and global list
-
-    // First, identify which global messages are delivered or expired
-    std::vector<bool> remove_global(g_messages.size(), false);
-
-    for (size_t gi = 0; gi < g_messages.size(); ++gi) {
-        Message &gm = g_messages[gi];
+    // Run body(c, lo, hi) over [0, n) split into contiguous chunks of at least
+    // PARALLEL_MIN_CHUNK items, one per routing thread; chunk c works with
+    // g_sim->worker_logs[c]. Returns the number of chunks.
+    const uint32_t threads = g_sim->thread_count > 0 ? g_sim->thread_count : 1;
+    if (g_sim->worker_logs.size() < threads) g_sim->worker_logs.resize(threads);
+    auto for_chunks = [&](uint32_t n, auto &&body) -> uint32_t {
+        uint32_t chunks = std::min(threads, n / PARALLEL_MIN_CHUNK);
+        if (chunks < 1) chunks = 1;
+        auto run_chunk = [&](uint32_t c) {
+            ContextScope chunk_context(sim); // also on the routing threads
+            DTNSIM_TRACE_SCOPE(chunk_scope, "routing chunk");
+            const uint32_t lo = static_cast<uint32_t>(static_cast<uint64_t>(n) * c / chunks);
+            const uint32_t hi = static_cast<uint32_t>(static_cast<uint64_t>(n) * (c + 1) / chunks);
+            body(c, lo, hi);
+        };
+#ifdef DTNSIM_THREADS
+        if (chunks > 1) {
+            g_sim->pool.run(chunks, run_chunk);
+            return chunks;
+        }
+#endif
+        for (uint32_t c = 0; c < chunks; ++c) run_chunk(c);
+        return chunks;
+    };
 
-        // Destination handling: if any agent holding gm has id == dst, treat as delivered
-        bool delivered = false;
-        for (const Agent &a : g_agents) {
-            if (a.id != gm.dst) continue;
-            for (const Message &m : a.messages) {
-                if (m.src==gm.src && m.dst==gm.dst && m.seq==gm.seq) {
-                    delivered = true;
-                    break;
+    // Epidemic with the initial message as the only live one, while every agent that
+    // ever received it still holds its copy: the delivered flags are then exactly the
+    // holdings. Once the destination has it the message leaves the system, so after
+    // that there is nothing left to route.
+    const bool single_message = g_sim->routing_mode == 1 && !g_sim->immunity && !link_limited &&
+                                g_sim->messages.size() == 1 && g_sim->messages[0].seq == 1 &&
+                                g_sim->message_meta[0].copies == g_sim->stats.delivered;
+
+    if (g_sim->routing_mode == 5) {
+        route_ensemble(encounters);
+    } else if (g_sim->messages.empty() && !g_sim->immunity && g_sim->routing_mode != 2 && g_sim->routing_mode != 3) {
+        // No message to forward, and CarryOnly and Epidemic keep no per-contact state
+    } else if (single_message) {
+        // An encounter is settled by the two flags; only one with exactly one holder
+        // transfers. Walking the list in order gives what the rounds below would.
+        // A flag of 2 marks a copy received in this step, which is not forwarded on.
+        std::vector<uint8_t> &held = g_sim->agent_delivered;
+        std::vector<uint32_t> &fresh = g_sim->scratch.fresh;
+        RoutingLog &log = g_sim->worker_logs[0];
+        fresh.clear();
+        auto infect = [&](uint32_t from_idx, uint32_t to_idx) {
+            transfer(to_idx, *g_sim->agents[from_idx].buffer.find(1), log);
+            held[to_idx] = 2;
+            fresh.push_back(to_idx);
+        };
+        for (const Encounter &enc : encounters) {
+            const uint8_t ha = held[enc.a_idx];
+            const uint8_t hb = held[enc.b_idx];
+            if (ha == 1 && hb == 0) {
+                infect(enc.a_idx, enc.b_idx);
+            } else if (ha == 0 && hb == 1) {
+                infect(enc.b_idx, enc.a_idx);
+            } else if (ha && hb) {
+                log.stats.duplicate_offers += (ha == 1) + (hb == 1);
+            }
+        }
+        for (uint32_t idx : fresh) held[idx] = 1;
+        flush_log(log);
+        remove_copyless();
+    } else if (g_sim->routing_mode == 4) {
+        // Epidemic, bulk-synchronous: every encounter reads the holdings agents had
+        // when routing started and only queues what it sends; the queued copies are
+        // stored afterwards, receiver by receiver. Encounters therefore neither
+        // depend on each other nor on their order. A message only reaches agents
+        // one hop from its holders per step, and a receiver offered the same
+        // message by several peers keeps one copy (the one with the fewest hops).
+        const uint32_t sent_chunks = for_chunks(encounter_count, [&](uint32_t c, uint32_t lo, uint32_t hi) {
+            RoutingLog &log = g_sim->worker_logs[c];
+            for (uint32_t e = lo; e < hi; ++e) {
+                const Encounter &enc = encounters[e];
+                const Agent &a = g_sim->agents[enc.a_idx];
+                const Agent &b = g_sim->agents[enc.b_idx];
+                Link ab{nullptr, 0.0};
+                Link ba{nullptr, 0.0};
+                if (contact_of[e]) {
+                    ab = Link{ &contact_of[e]->dir[0], step_budget };
+                    ba = Link{ &contact_of[e]->dir[1], step_budget };
                 }
+                auto send_ab = [&](const Message &m) -> bool {
+                    if (holds(b, m.seq)) {
+                        log.stats.duplicate_offers++;
+                        return true;
+                    }
+                    return offer(ab, m, [&] { log.outbox.push_back(Delivery{ enc.b_idx, m }); });
+                };
+                resume(ab, a, b, log, send_ab);
+                a.buffer.for_each_while(send_ab);
+                auto send_ba = [&](const Message &m) -> bool {
+                    if (holds(a, m.seq)) {
+                        log.stats.duplicate_offers++;
+                        return true;
+                    }
+                    return offer(ba, m, [&] { log.outbox.push_back(Delivery{ enc.a_idx, m }); });
+                };
+                resume(ba, b, a, log, send_ba);
+                b.buffer.for_each_while(send_ba);
             }
-            if (delivered) break;
+        });
+
+        std::vector<Delivery> &inbox = g_sim->scratch.inbox;
+        inbox.clear();
+        for (uint32_t c = 0; c < sent_chunks; ++c) {
+            RoutingLog &log = g_sim->worker_logs[c];
+            inbox.insert(inbox.end(), log.outbox.begin(), log.outbox.end());
+            log.outbox.clear();
         }
-
-        if (delivered) {
-            remove_global[gi] = true;
-            // stats.delivered already incremented when destination first received the message
+        std::sort(inbox.begin(), inbox.end(), [](const Delivery &x, const Delivery &y) {
+            if (x.to_idx != y.to_idx) return x.to_idx < y.to_idx;
+            if (x.msg.seq != y.msg.seq) return x.msg.seq < y.msg.seq;
+            return x.msg.hops < y.msg.hops;
+        });
+
+        // Store the copies. Chunk borders are moved to receiver boundaries so each
+        // receiver is handled by exactly one chunk.
+        const uint32_t inbox_size = static_cast<uint32_t>(inbox.size());
+        auto receiver_start = [&](uint32_t i) {
+            while (i > 0 && i < inbox_size && inbox[i].to_idx == inbox[i - 1].to_idx) ++i;
+            return i;
+        };
+        const uint32_t store_chunks = for_chunks(inbox_size, [&](uint32_t c, uint32_t lo, uint32_t hi) {
+            RoutingLog &log = g_sim->worker_logs[c];
+            for (uint32_t i = receiver_start(lo); i < receiver_start(hi); ++i) {
+                const Delivery &d = inbox[i];
+                if (i > 0 && inbox[i - 1].to_idx == d.to_idx && inbox[i - 1].msg.seq == d.msg.seq) {
+                    // Sent by more than one peer in this step
+                    log.stats.tx++;
+                    log.stats.rx++;
+                    log.stats.duplicates++;
+                    continue;
+                }
+                transfer(d.to_idx, d.msg, log);
+            }
+        });
+        // The send phase may have used more logs than the store phase (its counters)
+        for (uint32_t c = 0; c < std::max(sent_chunks, store_chunks); ++c) flush_log(g_sim->worker_logs[c]);
+        remove_copyless();
+    } else {
+        // Encounters are grouped into rounds in which no agent appears twice. An
+        // encounter goes into the round after the last one holding either of its
+        // agents, so every agent still sees its encounters in list order and running
+        // the rounds one after another gives the same result as walking the list.
+        // The encounters of a round are independent and may run on several threads;
+        // their logs are flushed in encounter order after the round, which keeps
+        // the outcome independent of the thread count.
+        std::vector<uint32_t> &next_round = g_sim->scratch.next_round;
+        std::vector<uint32_t> &round_start = g_sim->scratch.round_start;
+        std::vector<uint32_t> &enc_round = g_sim->scratch.enc_round;
+        next_round.assign(agent_count, 0);
+        round_start.assign(1, 0);
+        enc_round.resize(encounter_count);
+        for (uint32_t e = 0; e < encounter_count; ++e) {
+            const Encounter &enc = encounters[e];
+            const uint32_t r = std::max(next_round[enc.a_idx], next_round[enc.b_idx]);
+            enc_round[e] = r;
+            next_round[enc.a_idx] = next_round[enc.b_idx] = r + 1;
+            if (round_start.size() < r + 2) round_start.resize(r + 2, 0);
+            round_start[r + 1]++;
+        }
+        for (size_t r = 1; r < round_start.size(); ++r) round_start[r] += round_start[r - 1];
+        std::vector<uint32_t> &order = g_sim->scratch.order;
+        std::vector<uint32_t> &fill = g_sim->scratch.fill;
+        order.resize(encounter_count);
+        fill.assign(round_start.begin(), round_start.end() - 1);
+        for (uint32_t e = 0; e < encounter_count; ++e) order[fill[enc_round[e]]++] = e;
+
+        for (size_t r = 0; r + 1 < round_start.size(); ++r) {
+            const uint32_t begin = round_start[r];
+            const uint32_t chunks = for_chunks(round_start[r + 1] - begin, [&](uint32_t c, uint32_t lo, uint32_t hi) {
+                for (uint32_t i = begin + lo; i < begin + hi; ++i) {
+                    route_encounter(encounters[order[i]], contact_of[order[i]], g_sim->worker_logs[c]);
+                }
+            });
+            for (uint32_t c = 0; c < chunks; ++c) flush_log(g_sim->worker_logs[c]);
+            remove_copyless();
         }
     }
 
-    // Remove from global list
-    std::vector<Message> new_global;
-    new_global.reserve(g_messages.size());
-    for (size_t gi = 0; gi < g_messages.size(); ++gi) {
-        if (!remove_global[gi]) new_global.push_back(g_messages[gi]);
-    }
-    g_messages.swap(new_global);
-
-    // Remove from agents' buffers
-    for (Agent &a : g_agents) {
-        std::vector<Message> kept;
-        kept.reserve(a.messages.size());
-        for (const Message &m : a.messages) {
-            bool alive = false;
-            for (const Message &gm : g_messages) {
-                if (gm.src==m.src && gm.dst==m.dst && gm.seq==m.seq) {
-                    alive = true;
-                    break;
-                }
+    DTNSIM_PROFILE_LAP(routing_ms);
+    DTNSIM_TRACE_NEXT(phase, "expiry");
+
+    // 4. TTL handling
+    // Messages with a non-zero ttl expire at created_at + ttl. Expirations sit on a
+    // timing wheel, so this costs only the messages due now (plus their copies);
+    // entries for messages already delivered or dropped are ignored when they fire.
+    g_sim->expiry_wheel.advance(static_cast<uint64_t>(g_sim->sim_time / TTL_TICK), [](uint32_t seq) {
+        if (find_message_pos(seq) < 0) return;
+        purge_message(seq);
+        g_sim->stats.expired++;
+    });
+
+    DTNSIM_PROFILE_LAP(expiry_ms);
+    DTNSIM_TRACE_NEXT(phase, "delivery");
+
+    // 5. Delivery check and message removal
+    // We maintain g_sim->messages as the set of all active (non-delivered, non-expired) messages.
+    // Messages that reached their destination are removed from all agents and the global list.
+    // A message counts as delivered once its destination holds a copy. Only messages
+    // handed to their destination in this step can qualify, so just those are checked
+    // (the copy may have been evicted or expired again since). Latency and hops are
+    // taken from the message's creation time and the destination's copy.
+    for (uint32_t seq : g_sim->reached_destination) {
+        const int pos = find_message_pos(seq);
+        if (pos < 0) continue;
+        const uint32_t dst_idx = g_sim->messages[pos].dst - 1;
+        const Message *copy = dst_idx < g_sim->agents.size() ? g_sim->agents[dst_idx].buffer.find(seq) : nullptr;
+        if (copy) {
+            const double latency = g_sim->sim_time - g_sim->message_meta[pos].created_at;
+            histogram_add(g_sim->delivery_hist.latency_ms, static_cast<uint64_t>(std::llround(std::max(latency, 0.0) * 1000.0)));
+            histogram_add(g_sim->delivery_hist.hops, copy->hops);
+            // stats.delivered already incremented when destination first received the message
+            if (g_sim->immunity) {
+                // The destination consumes its copy and starts the anti-packet; the
+                // other copies go as it spreads
+                std::vector<uint32_t> &immune = g_sim->agents[dst_idx].immune;
+                immune.insert(std::upper_bound(immune.begin(), immune.end(), seq), seq);
+                drop_copy(dst_idx, seq, g_sim->log);
+            } else {
+                purge_message(seq);
             }
-            if (alive) kept.push_back(m);
         }
-        a.messages.swap(kept);
     }
+    g_sim->reached_destination.clear();
+    if (g_sim->immunity) {
+        flush_log(g_sim->log);
+        remove_copyless();
+    }
+
+    DTNSIM_PROFILE_LAP(delivery_ms);
+    DTNSIM_TRACE_NEXT(phase, "checks");
 
     // 6. Statistics update
-    // All stat counters (tx, rx, duplicates, delivered) are maintained inline above.
+    // All stat counters (tx, rx, duplicates, duplicate_offers, delivered, dropped, expired,
+    // created, immunized) are maintained inline above.
+#ifdef DTNSIM_PROFILE
+    g_sim->profile.total_ms = g_sim->phase_clock.total();
+    g_sim->profile.transfers = g_sim->stats.tx - g_sim->profile_tx_before;
+    g_sim->profile.allocations = g_alloc_count.load(std::memory_order_relaxed) - g_sim->profile_allocs_before;
+#endif
+#ifdef DTNSIM_ALLOC_TRACKING
+    g_sim->alloc_stats.enabled = 1;
+    g_sim->alloc_stats.step = g_sim->step_index;
+    g_sim->alloc_stats.total_allocations = g_alloc_count.load(std::memory_order_relaxed);
+    g_sim->alloc_stats.total_bytes = g_alloc_bytes.load(std::memory_order_relaxed);
+    g_sim->alloc_stats.step_allocations = g_sim->alloc_stats.total_allocations - g_sim->alloc_count_before;
+    g_sim->alloc_stats.step_bytes = g_sim->alloc_stats.total_bytes - g_sim->alloc_bytes_before;
+#ifdef __EMSCRIPTEN__
+    g_sim->alloc_stats.heap_in_use = emmalloc_dynamic_heap_size() - emmalloc_free_dynamic_memory();
+#endif
+#endif
+#ifdef DTNSIM_REFERENCE
+    // Differential mode: advance the reference and compare (outside the profile and
+    // allocation counts above)
+    if (g_sim->ref.active) ref_step(dt);
+#endif
 
 #ifndef NDEBUG
     // Lightweight consistency check (debug-only):
-    //  - Every global message must be held by at least one agent
-    //  - Every per-agent message must exist in g_messages
-    for (const Message &gm : g_messages) {
-        bool found = false;
-        for (const Agent &a : g_agents) {
-            for (const Message &m : a.messages) {
-                if (m.src==gm.src && m.dst==gm.dst && m.seq==gm.seq) {
-                    found = true;
-                    break;
-                }
+    //  - Every global message must be held by `copies` agents (at least one), all of
+    //    them in its holder list
+    //  - Every per-agent message must exist in g_sim->messages
+    //  - Buffers respect the configured capacity
+    for (size_t gi = 0; gi < g_sim->messages.size(); ++gi) {
+        const Message &gm = g_sim->messages[gi];
+        const MessageMeta &meta = g_sim->message_meta[gi];
+        uint32_t holders = 0;
+        for (uint32_t ai = 0; ai < g_sim->agents.size(); ++ai) {
+            if (!g_sim->agents[ai].buffer.contains(gm.seq)) continue;
+            holders++;
+            if (std::find(meta.holders.begin(), meta.holders.end(), ai) == meta.holders.end()) {
+                abort();
             }
-            if (found) break;
         }
-        if (!found) {
+        if (holders == 0 || holders != meta.copies || find_message_pos(gm.seq) != static_cast<int>(gi)) {
             // In debug builds, abort early if invariants are broken.
             abort();
         }
     }
 
-    for (const Agent &a : g_agents) {
-        for (const Message &m : a.messages) {
-            bool found = false;
-            for (const Message &gm : g_messages) {
-                if (gm.src==m.src && gm.dst==m.dst && gm.seq==m.seq) {
-                    found = true;
-                    break;
-                }
+    for (const Agent &a : g_sim->agents) {
+        // MaxProp queue mirrors the buffer exactly
+        if (g_sim->routing_mode == 3 && a.maxprop_queue.size() != a.buffer.size()) {
+            abort();
+        }
+        if (g_sim->buffer_capacity > 0 && a.buffer.size() > g_sim->buffer_capacity) {
+            abort();
+        }
+        // Summary vectors never miss a held message
+        if (g_sim->summary_vectors && a.summary.size() != a.buffer.size()) {
+            abort();
+        }
+        a.buffer.for_each([&](const Message &m) {
+            if (find_message_pos(m.seq) < 0) {
+                abort();
             }
-            if (!found) {
+            // An agent never keeps a copy of a message it is immune to
+            if (g_sim->immunity && immune_to(a, m.seq)) {
                 abort();
             }
+            if (g_sim->summary_vectors && !a.summary.maybe_contains(m.seq)) {
+                abort();
+            }
+        });
+    }
+#endif
+}
+} // namespace
+
+void dtnsim_ctx_step(DtnSim* sim, double dt) {
+    ContextScope scope(sim);
+    if (g_sim->leader) return; // followers step with their leader
+    step_context(dt);
+    for (DtnSim *follower : sim->followers) {
+        // Counts only differ here while one side is reset (init detaches on a mismatch)
+        if (follower->agent_count != sim->agent_count) continue;
+        ContextScope follower_scope(follower);
+        step_context(dt);
+    }
+}
+
+// Attach follower to leader's mobility and encounters (leader NULL detaches)
+uint32_t dtnsim_ctx_follow(DtnSim* follower, DtnSim* leader) {
+    if (!follower || follower == leader) return 0;
+    if (leader && (leader->leader || !follower->followers.empty())) return 0;
+    if (leader && follower->agent_count != leader->agent_count) return 0;
+    if (follower->leader) {
+        std::vector<DtnSim*> &siblings = follower->leader->followers;
+        siblings.erase(std::find(siblings.begin(), siblings.end(), follower));
+    }
+    follower->leader = leader;
+    if (leader) leader->followers.push_back(follower);
+    return 1;
+}
+
+DtnSim* dtnsim_default_context() {
+    return &g_default_sim;
+}
+
+// Toggle differential checking against the reference engine (from the next dtnsim_init)
+uint32_t dtnsim_ctx_set_differential(DtnSim* sim, uint32_t enabled) {
+    ContextScope scope(sim);
+#ifdef DTNSIM_REFERENCE
+    g_sim->differential = enabled != 0;
+    return 1;
+#else
+    (void)enabled;
+    return 0;
+#endif
+}
+
+const char* dtnsim_ctx_get_divergence(DtnSim* sim) {
+    ContextScope scope(sim);
+#ifdef DTNSIM_REFERENCE
+    return g_sim->divergence.empty() ? nullptr : g_sim->divergence.c_str();
+#else
+    return nullptr;
+#endif
+}
+
+// Set the side of the world box used by the next dtnsim_init calls
+void dtnsim_ctx_set_world_size(DtnSim* sim, double side) {
+    ContextScope scope(sim);
+    g_sim->world_size = side > 0.0 ? static_cast<float>(side) : 1500.0f;
+}
+
+// Fix the seed of the next dtnsim_init calls
+void dtnsim_ctx_set_seed(DtnSim* sim, uint32_t seed) {
+    ContextScope scope(sim);
+    g_sim->seeded = true;
+    g_sim->seed = seed;
+    g_sim->graph_seeded = false;
+}
+
+// Draw the graph of the next seeded dtnsim_init calls from graph_seed
+void dtnsim_ctx_set_graph_seed(DtnSim* sim, uint32_t graph_seed) {
+    ContextScope scope(sim);
+    g_sim->graph_seeded = true;
+    g_sim->graph_seed = graph_seed;
+}
+
+// Configure per-agent buffer capacity and drop policy
+void dtnsim_ctx_set_buffer_policy(DtnSim* sim, uint32_t capacity, const char* policy_name) {
+    ContextScope scope(sim);
+    g_sim->buffer_capacity = capacity;
+    if (policy_name && strcmp(policy_name, "drop-oldest") == 0) {
+        g_sim->drop_policy = 1;
+    } else if (policy_name && strcmp(policy_name, "drop-youngest") == 0) {
+        g_sim->drop_policy = 2;
+    } else if (policy_name && strcmp(policy_name, "random") == 0) {
+        g_sim->drop_policy = 3;
+    } else {
+        g_sim->drop_policy = 0; // "drop-head" (default)
+    }
+    reserve_run_storage();
+}
+
+// Configure contact bandwidth and the size of messages created from now on
+void dtnsim_ctx_set_link_rate(DtnSim* sim, double bytes_per_second) {
+    ContextScope scope(sim);
+    g_sim->link_rate = bytes_per_second > 0.0 ? bytes_per_second : 0.0;
+    reserve_run_storage();
+}
+
+void dtnsim_ctx_set_message_size(DtnSim* sim, uint32_t bytes) {
+    ContextScope scope(sim);
+    g_sim->default_message_size = bytes;
+}
+
+// Configure the TTL given to messages created from now on
+void dtnsim_ctx_set_message_ttl(DtnSim* sim, uint32_t ttl_seconds) {
+    ContextScope scope(sim);
+    g_sim->default_ttl = ttl_seconds;
+}
+
+// Toggle immunity mode; agents keep their anti-packets when it is switched off
+void dtnsim_ctx_set_immunity(DtnSim* sim, uint32_t enabled) {
+    ContextScope scope(sim);
+    g_sim->immunity = enabled != 0;
+}
+
+// Toggle Bloom summary vectors; enabling builds every agent's filter from its buffer
+void dtnsim_ctx_set_summary_vectors(DtnSim* sim, uint32_t enabled) {
+    ContextScope scope(sim);
+    g_sim->summary_vectors = enabled != 0;
+    for (Agent &ag : g_sim->agents) {
+        if (g_sim->summary_vectors) {
+            rebuild_summary(ag);
+        } else {
+            ag.summary.clear();
         }
     }
+}
+
+// Set the number of routing threads (0 or 1 = route on the calling thread)
+void dtnsim_ctx_set_threads(DtnSim* sim, uint32_t count) {
+    ContextScope scope(sim);
+    g_sim->thread_count = count > 0 ? count : 1;
+#ifdef DTNSIM_THREADS
+    g_sim->pool.resize(g_sim->thread_count);
 #endif
+    reserve_run_storage();
+}
+
+// Configure the Poisson traffic generator
+void dtnsim_ctx_set_traffic(DtnSim* sim, double rate_per_agent, uint32_t hotspot_count, double hotspot_fraction) {
+    ContextScope scope(sim);
+    g_sim->traffic_rate = rate_per_agent > 0.0 ? rate_per_agent : 0.0;
+    g_sim->hotspot_fraction = hotspot_fraction < 0.0 ? 0.0 : (hotspot_fraction > 1.0 ? 1.0 : hotspot_fraction);
+    if (hotspot_count != g_sim->hotspot_count) {
+        g_sim->hotspot_count = hotspot_count;
+        g_sim->hotspots.clear();
+    }
+}
+
+// Create messages from packed MessageInjection records; returns the number accepted
+uint32_t dtnsim_ctx_inject_messages(DtnSim* sim, const uint32_t* packed, uint32_t count) {
+    ContextScope scope(sim);
+    if (!packed) return 0;
+    const MessageInjection *recs = reinterpret_cast<const MessageInjection*>(packed);
+    uint32_t accepted = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const MessageInjection &r = recs[i];
+        if (r.at_ms * 1e-3 <= g_sim->sim_time) {
+            if (inject_now(r, g_sim->sim_time)) accepted++;
+            continue;
+        }
+        if (r.src - 1 >= g_sim->agents.size() || r.dst - 1 >= g_sim->agents.size() || r.src == r.dst) continue;
+        g_sim->pending_injections.push_back(PendingInjection{ r, g_sim->injection_order++ });
+        std::push_heap(g_sim->pending_injections.begin(), g_sim->pending_injections.end(), injection_after);
+        accepted++;
+    }
+    return accepted;
+}
+
+// Keep up to DTNSIM_ENSEMBLE_REPLICAS source agents for the next ensemble inits
+uint32_t dtnsim_ctx_set_ensemble_sources(DtnSim* sim, const uint32_t* agent_indices, uint32_t count) {
+    ContextScope scope(sim);
+    const uint32_t kept = agent_indices ? std::min<uint32_t>(count, DTNSIM_ENSEMBLE_REPLICAS) : 0;
+    g_sim->ensemble_sources.assign(agent_indices, agent_indices + kept);
+    return kept;
+}
+
+const EnsembleStats* dtnsim_ctx_get_ensemble_stats(DtnSim* sim) {
+    ContextScope scope(sim);
+    return &g_sim->ensemble;
+}
+
+const uint64_t* dtnsim_ctx_get_ensemble_state(DtnSim* sim) {
+    ContextScope scope(sim);
+    return g_sim->ensemble.replicas ? g_sim->ensemble_held.data() : nullptr;
+}
+
+// --- Default context ---
+// The context-free API of the web UI and existing embedders: the same calls on g_default_sim
+
+void dtnsim_reset() {
+    dtnsim_ctx_reset(&g_default_sim);
+}
+
+const NodePositionsBuffer* dtnsim_get_node_positions() {
+    return dtnsim_ctx_get_node_positions(&g_default_sim);
+}
+
+const NodePositionsBuffer* dtnsim_get_agent_positions() {
+    return dtnsim_ctx_get_agent_positions(&g_default_sim);
+}
+
+const RoutingStats* dtnsim_get_stats() {
+    return dtnsim_ctx_get_stats(&g_default_sim);
+}
+
+const DeliveryHistograms* dtnsim_get_delivery_histograms() {
+    return dtnsim_ctx_get_delivery_histograms(&g_default_sim);
+}
+
+const StepProfile* dtnsim_get_profile() {
+    return dtnsim_ctx_get_profile(&g_default_sim);
+}
+
+uint32_t dtnsim_set_perf_counters(uint32_t enabled) {
+    return dtnsim_ctx_set_perf_counters(&g_default_sim, enabled);
+}
+
+const AllocStats* dtnsim_get_alloc_stats() {
+    return dtnsim_ctx_get_alloc_stats(&g_default_sim);
+}
+
+const Message* dtnsim_get_message_list(uint32_t* out_count) {
+    return dtnsim_ctx_get_message_list(&g_default_sim, out_count);
+}
+
+void dtnsim_init(uint32_t agent_count, const char* routing_name) {
+    dtnsim_ctx_init(&g_default_sim, agent_count, routing_name);
+}
+
+const uint8_t* dtnsim_get_agent_delivered_flags() {
+    return dtnsim_ctx_get_agent_delivered_flags(&g_default_sim);
+}
+
+void dtnsim_step(double dt) {
+    dtnsim_ctx_step(&g_default_sim, dt);
+}
+
+uint32_t dtnsim_set_differential(uint32_t enabled) {
+    return dtnsim_ctx_set_differential(&g_default_sim, enabled);
+}
+
+const char* dtnsim_get_divergence() {
+    return dtnsim_ctx_get_divergence(&g_default_sim);
+}
+
+void dtnsim_set_world_size(double side) {
+    dtnsim_ctx_set_world_size(&g_default_sim, side);
+}
+
+void dtnsim_set_seed(uint32_t seed) {
+    dtnsim_ctx_set_seed(&g_default_sim, seed);
+}
+
+void dtnsim_set_graph_seed(uint32_t graph_seed) {
+    dtnsim_ctx_set_graph_seed(&g_default_sim, graph_seed);
+}
+
+void dtnsim_set_buffer_policy(uint32_t capacity, const char* policy_name) {
+    dtnsim_ctx_set_buffer_policy(&g_default_sim, capacity, policy_name);
+}
+
+void dtnsim_set_link_rate(double bytes_per_second) {
+    dtnsim_ctx_set_link_rate(&g_default_sim, bytes_per_second);
+}
+
+void dtnsim_set_message_size(uint32_t bytes) {
+    dtnsim_ctx_set_message_size(&g_default_sim, bytes);
+}
+
+void dtnsim_set_message_ttl(uint32_t ttl_seconds) {
+    dtnsim_ctx_set_message_ttl(&g_default_sim, ttl_seconds);
+}
+
+void dtnsim_set_immunity(uint32_t enabled) {
+    dtnsim_ctx_set_immunity(&g_default_sim, enabled);
+}
+
+void dtnsim_set_summary_vectors(uint32_t enabled) {
+    dtnsim_ctx_set_summary_vectors(&g_default_sim, enabled);
+}
+
+void dtnsim_set_threads(uint32_t count) {
+    dtnsim_ctx_set_threads(&g_default_sim, count);
+}
+
+void dtnsim_set_traffic(double rate_per_agent, uint32_t hotspot_count, double hotspot_fraction) {
+    dtnsim_ctx_set_traffic(&g_default_sim, rate_per_agent, hotspot_count, hotspot_fraction);
+}
+
+uint32_t dtnsim_inject_messages(const uint32_t* packed, uint32_t count) {
+    return dtnsim_ctx_inject_messages(&g_default_sim, packed, count);
+}
+
+uint32_t dtnsim_set_ensemble_sources(const uint32_t* agent_indices, uint32_t count) {
+    return dtnsim_ctx_set_ensemble_sources(&g_default_sim, agent_indices, count);
+}
+
+const EnsembleStats* dtnsim_get_ensemble_stats() {
+    return dtnsim_ctx_get_ensemble_stats(&g_default_sim);
+}
+
+const uint64_t* dtnsim_get_ensemble_state() {
+    return dtnsim_ctx_get_ensemble_state(&g_default_sim);
 }
 
 #ifdef __cplusplus
@@ -0,0 +1,348 @@
+// dtnsim-cli: headless native runner for the simulator in bindings.cpp.
+// Runs one simulation through the same C ABI the web UI uses and reports the wall
+// time, steps per second and the final RoutingStats.
+
+#include "dtnsim_api.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options {
+    uint32_t agents = 100;
+    std::string routing = "epidemic";
+    std::vector<std::string> also; // routing modes run on the same mobility and encounters
+    double dt = 0.016; // the web UI's step at 1x speed
+    uint32_t steps = 1000;
+    uint32_t seed = 1;
+    uint32_t threads = 1;
+    double traffic = 0.0;
+    uint32_t buffer = 0;
+    std::string policy = "drop-head";
+    uint32_t ttl = 0;
+    double link_rate = 0.0;
+    bool summary_vectors = false;
+    bool immunity = false;
+    const char* trace_path = nullptr;
+    int64_t check_allocs = -1; // warm-up steps before allocations count as failures
+    bool differential = false;
+    bool phases = false;       // per-phase breakdown from StepProfile
+    bool perf_counters = false; // with hardware counters
+};
+
+void usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --agents N          agents and graph nodes (default 100)\n"
+        "  --routing NAME      carryonly, epidemic, prophet, maxprop, epidemic_bsp,\n"
+        "                      epidemic_ensemble (default epidemic)\n"
+        "  --also LIST         more routing modes, comma-separated, run on the same mobility\n"
+        "                      and encounters (one detection pass for all)\n"
+        "  --dt S              simulation seconds per step (default 0.016)\n"
+        "  --steps N           steps to run (default 1000)\n"
+        "  --seed N            seed of dtnsim_set_seed (default 1)\n"
+        "  --threads N         routing threads (needs a DTNSIM_THREADS build)\n"
+        "  --traffic RATE      Poisson messages per agent per second (default 0)\n"
+        "  --buffer N          per-agent buffer capacity (default 0 = unbounded)\n"
+        "  --policy NAME       drop policy of full buffers (default drop-head)\n"
+        "  --ttl S             message TTL in seconds (default 0 = no expiry)\n"
+        "  --link-rate B       contact bandwidth in bytes/s (default 0 = unlimited)\n"
+        "  --summary-vectors   enable Bloom summary vectors\n"
+        "  --immunity          enable anti-packet immunity\n"
+        "  --trace PATH        write a Chrome trace (needs a DTNSIM_TRACE build)\n"
+        "  --check-allocs W    fail if any step after the first W allocates\n"
+        "                      (needs a DTNSIM_ALLOC_TRACKING build)\n"
+        "  --phases            print wall time per step phase (needs a DTNSIM_PROFILE build)\n"
+        "  --perf-counters     --phases with cycles, instructions, LLC and branch misses\n"
+        "                      per phase (Linux perf_event_open; falls back to wall time)\n"
+        "  --differential      check every step against the reference engine and fail\n"
+        "                      on the first divergence (needs a DTNSIM_REFERENCE build)\n",
+        argv0);
+}
+
+bool parse(int argc, char** argv, Options& o) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        auto need = [&]() {
+            if (!val) {
+                std::fprintf(stderr, "%s needs a value\n", arg);
+                return false;
+            }
+            ++i;
+            return true;
+        };
+        if (std::strcmp(arg, "--agents") == 0) {
+            if (!need()) return false;
+            o.agents = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--routing") == 0) {
+            if (!need()) return false;
+            o.routing = val;
+        } else if (std::strcmp(arg, "--also") == 0) {
+            if (!need()) return false;
+            o.also.clear();
+            std::string name;
+            for (const char* c = val;; ++c) {
+                if (*c == ',' || *c == '\0') {
+                    if (!name.empty()) o.also.push_back(name);
+                    name.clear();
+                    if (*c == '\0') break;
+                } else {
+                    name += *c;
+                }
+            }
+        } else if (std::strcmp(arg, "--dt") == 0) {
+            if (!need()) return false;
+            o.dt = std::strtod(val, nullptr);
+        } else if (std::strcmp(arg, "--steps") == 0) {
+            if (!need()) return false;
+            o.steps = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--seed") == 0) {
+            if (!need()) return false;
+            o.seed = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--threads") == 0) {
+            if (!need()) return false;
+            o.threads = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--traffic") == 0) {
+            if (!need()) return false;
+            o.traffic = std::strtod(val, nullptr);
+        } else if (std::strcmp(arg, "--buffer") == 0) {
+            if (!need()) return false;
+            o.buffer = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--policy") == 0) {
+            if (!need()) return false;
+            o.policy = val;
+        } else if (std::strcmp(arg, "--ttl") == 0) {
+            if (!need()) return false;
+            o.ttl = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--link-rate") == 0) {
+            if (!need()) return false;
+            o.link_rate = std::strtod(val, nullptr);
+        } else if (std::strcmp(arg, "--summary-vectors") == 0) {
+            o.summary_vectors = true;
+        } else if (std::strcmp(arg, "--immunity") == 0) {
+            o.immunity = true;
+        } else if (std::strcmp(arg, "--phases") == 0) {
+            o.phases = true;
+        } else if (std::strcmp(arg, "--perf-counters") == 0) {
+            o.phases = o.perf_counters = true;
+        } else if (std::strcmp(arg, "--differential") == 0) {
+            o.differential = true;
+        } else if (std::strcmp(arg, "--trace") == 0) {
+            if (!need()) return false;
+            o.trace_path = val;
+        } else if (std::strcmp(arg, "--check-allocs") == 0) {
+            if (!need()) return false;
+            o.check_allocs = std::strtoll(val, nullptr, 10);
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", arg);
+            return false;
+        }
+    }
+    if (o.dt <= 0.0) {
+        std::fprintf(stderr, "--dt must be positive\n");
+        return false;
+    }
+    // The reference engine stops at once outside what it implements (see dtnsim_set_differential)
+    if (o.differential) {
+        std::string unsupported;
+        if (o.routing != "carryonly" && o.routing != "epidemic" && o.routing != "epidemic_bsp") {
+            unsupported = "--routing " + o.routing;
+        } else if (o.link_rate > 0.0) {
+            unsupported = "--link-rate";
+        } else if (o.policy == "random") {
+            unsupported = "--policy random";
+        } else if (o.immunity) {
+            unsupported = "--immunity";
+        }
+        if (!unsupported.empty()) {
+            std::fprintf(stderr, "--differential does not support %s: the reference engine covers carryonly, "
+                                 "epidemic and epidemic_bsp without link rate, immunity or the random drop policy\n",
+                         unsupported.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Settings shared by the simulation and its --also followers
+void configure(DtnSim* sim, const Options& o) {
+    dtnsim_ctx_set_seed(sim, o.seed);
+    dtnsim_ctx_set_threads(sim, o.threads);
+    dtnsim_ctx_set_buffer_policy(sim, o.buffer, o.policy.c_str());
+    dtnsim_ctx_set_message_ttl(sim, o.ttl);
+    dtnsim_ctx_set_link_rate(sim, o.link_rate);
+    dtnsim_ctx_set_traffic(sim, o.traffic, 0, 0.0);
+    dtnsim_ctx_set_summary_vectors(sim, o.summary_vectors ? 1 : 0);
+    dtnsim_ctx_set_immunity(sim, o.immunity ? 1 : 0);
+}
+
+void print_stats(const RoutingStats* st) {
+    std::printf("delivered=%llu tx=%llu rx=%llu duplicates=%llu duplicate_offers=%llu dropped=%llu "
+                "expired=%llu created=%llu immunized=%llu\n",
+                static_cast<unsigned long long>(st->delivered), static_cast<unsigned long long>(st->tx),
+                static_cast<unsigned long long>(st->rx), static_cast<unsigned long long>(st->duplicates),
+                static_cast<unsigned long long>(st->duplicate_offers),
+                static_cast<unsigned long long>(st->dropped), static_cast<unsigned long long>(st->expired),
+                static_cast<unsigned long long>(st->created), static_cast<unsigned long long>(st->immunized));
+}
+
+const char* const PHASE_NAMES[7] = { "traffic", "mobility", "grid", "pairs", "routing", "expiry", "delivery" };
+
+// Sums of StepProfile over the run, per phase
+struct PhaseTotals {
+    double ms[7] = {};
+    PhaseCounters counters[7] = {};
+    uint32_t perf_counters = 0; // counters present in every step (DTNSIM_PERF_* bits)
+    bool first = true;
+
+    void add(const StepProfile& p) {
+        const double step_ms[7] = { p.traffic_ms, p.mobility_ms, p.grid_ms, p.pairs_ms,
+                                    p.routing_ms, p.expiry_ms, p.delivery_ms };
+        for (int k = 0; k < 7; ++k) {
+            ms[k] += step_ms[k];
+            counters[k].cycles += p.phases[k].cycles;
+            counters[k].instructions += p.phases[k].instructions;
+            counters[k].llc_misses += p.phases[k].llc_misses;
+            counters[k].branch_misses += p.phases[k].branch_misses;
+        }
+        perf_counters = first ? p.perf_counters : (perf_counters & p.perf_counters);
+        first = false;
+    }
+
+    void print() const {
+        for (int k = 0; k < 7; ++k) {
+            std::printf("phase=%s ms=%.3f", PHASE_NAMES[k], ms[k]);
+            const PhaseCounters& c = counters[k];
+            if (perf_counters & DTNSIM_PERF_CYCLES) std::printf(" cycles=%llu", static_cast<unsigned long long>(c.cycles));
+            if (perf_counters & DTNSIM_PERF_INSTRUCTIONS) {
+                std::printf(" instructions=%llu", static_cast<unsigned long long>(c.instructions));
+            }
+            if ((perf_counters & DTNSIM_PERF_CYCLES) && (perf_counters & DTNSIM_PERF_INSTRUCTIONS)) {
+                std::printf(" ipc=%.2f", c.cycles ? static_cast<double>(c.instructions) / c.cycles : 0.0);
+            }
+            if (perf_counters & DTNSIM_PERF_LLC_MISSES) {
+                std::printf(" llc_misses=%llu", static_cast<unsigned long long>(c.llc_misses));
+            }
+            if (perf_counters & DTNSIM_PERF_BRANCH_MISSES) {
+                std::printf(" branch_misses=%llu", static_cast<unsigned long long>(c.branch_misses));
+            }
+            std::printf("\n");
+        }
+    }
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    Options o;
+    if (!parse(argc, argv, o)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (o.check_allocs >= 0 && !dtnsim_get_alloc_stats()->enabled) {
+        std::fprintf(stderr, "--check-allocs needs a build with DTNSIM_ALLOC_TRACKING\n");
+        return 2;
+    }
+
+    const StepProfile* prof = dtnsim_get_profile();
+    if (o.phases && !prof->enabled) {
+        std::fprintf(stderr, "--phases and --perf-counters need a build with DTNSIM_PROFILE\n");
+        return 2;
+    }
+    if (o.perf_counters && dtnsim_set_perf_counters(1) == 0) {
+        std::fprintf(stderr, "hardware counters are not available (perf_event_open failed); "
+                             "reporting wall time per phase only\n");
+    }
+    if (o.differential && !dtnsim_set_differential(1)) {
+        std::fprintf(stderr, "--differential needs a build with DTNSIM_REFERENCE\n");
+        return 2;
+    }
+
+    configure(dtnsim_default_context(), o);
+
+    const auto t_init = std::chrono::steady_clock::now();
+    dtnsim_init(o.agents, o.routing.c_str());
+    std::vector<DtnSim*> followers; // stepped by dtnsim_step along with the default context
+    for (const std::string& routing : o.also) {
+        DtnSim* sim = dtnsim_create();
+        configure(sim, o);
+        dtnsim_ctx_init(sim, o.agents, routing.c_str());
+        dtnsim_ctx_follow(sim, dtnsim_default_context());
+        followers.push_back(sim);
+    }
+    const auto t_run = std::chrono::steady_clock::now();
+
+    const AllocStats* alloc = dtnsim_get_alloc_stats();
+    uint32_t alloc_steps = 0; // steps past the warm-up that allocated
+    uint32_t steps_run = 0;   // fewer than o.steps when --differential stops at a divergence
+    PhaseTotals phases;
+    for (uint32_t s = 0; s < o.steps; ++s) {
+        if (o.differential && dtnsim_get_divergence()) break;
+        dtnsim_step(o.dt);
+        steps_run++;
+        if (o.phases) phases.add(*prof);
+        if (o.check_allocs >= 0 && s >= o.check_allocs && alloc->step_allocations > 0) {
+            if (alloc_steps == 0) {
+                std::fprintf(stderr, "step %u allocated %llu times (%llu bytes)\n", s,
+                             static_cast<unsigned long long>(alloc->step_allocations),
+                             static_cast<unsigned long long>(alloc->step_bytes));
+            }
+            alloc_steps++;
+        }
+    }
+    const auto t_end = std::chrono::steady_clock::now();
+
+    const double init_s = std::chrono::duration<double>(t_run - t_init).count();
+    const double wall_s = std::chrono::duration<double>(t_end - t_run).count();
+    const RoutingStats* st = dtnsim_get_stats();
+    std::printf("routing=%s agents=%u steps=%u dt=%g seed=%u threads=%u\n", o.routing.c_str(),
+                o.agents, steps_run, o.dt, o.seed, o.threads);
+    std::printf("init_s=%.6f wall_s=%.6f steps_per_s=%.1f\n", init_s, wall_s,
+                wall_s > 0.0 ? steps_run / wall_s : 0.0);
+    print_stats(st);
+    for (size_t f = 0; f < followers.size(); ++f) {
+        std::printf("also routing=%s ", o.also[f].c_str());
+        print_stats(dtnsim_ctx_get_stats(followers[f]));
+        dtnsim_destroy(followers[f]);
+    }
+    const EnsembleStats* ens = dtnsim_get_ensemble_stats();
+    if (ens->replicas > 0) {
+        // Full-spread times of the replicas that got there
+        uint32_t first = 0, last = 0;
+        for (uint32_t r = 0; r < ens->replicas; ++r) {
+            const uint32_t s = ens->full_spread_step[r];
+            if (s == 0) continue;
+            if (first == 0 || s < first) first = s;
+            last = std::max(last, s);
+        }
+        std::printf("ensemble_replicas=%u full_spread=%u first_full_spread_s=%.3f last_full_spread_s=%.3f\n",
+                    ens->replicas, ens->full_spread, first * o.dt, last * o.dt);
+    }
+    if (o.phases) phases.print();
+    if (o.trace_path) {
+        std::printf("trace_events=%u\n", dtnsim_write_trace(o.trace_path));
+    }
+    if (o.differential) {
+        const char* divergence = dtnsim_get_divergence();
+        std::printf("divergence=%s\n", divergence ? divergence : "none");
+        if (divergence) return 1;
+    }
+    if (o.check_allocs >= 0) {
+        std::printf("allocating_steps=%u\n", alloc_steps);
+        if (alloc_steps > 0) return 1;
+    }
+    return 0;
+}
@@ -8,41 +8,309 @@
 extern "C" {
 #endif
 
+// Counters are 64-bit so long high-traffic runs do not wrap (read them as
+// BigUint64Array from JS). Duplicates are the extra copies epidemic_bsp delivers to an
+// agent in one step and, with a link rate under any policy, transfers the receiver got
+// from another peer before their last byte arrived.
 typedef struct {
-    uint32_t delivered;
-    uint32_t tx;
-    uint32_t rx;
-    uint32_t duplicates;
+    uint64_t delivered;
+    uint64_t tx;
+    uint64_t rx;
+    uint64_t duplicates;       // transmissions received by an agent that already had the message
+    uint64_t dropped;          // message copies evicted from full agent buffers
+    uint64_t expired;          // messages removed because their TTL elapsed
+    uint64_t created;          // messages created (initial message, traffic generator, injections)
+    uint64_t duplicate_offers; // messages the routing policy would send but the peer already holds
+    uint64_t immunized;        // copies removed by anti-packets (immunity mode)
 } RoutingStats;
 
+// Streaming histogram with power-of-two buckets: bucket 0 counts the value 0,
+// bucket i (i >= 1) the values in [2^(i-1), 2^i); the last bucket is open-ended.
+#define DTNSIM_HISTOGRAM_BUCKETS 32
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[DTNSIM_HISTOGRAM_BUCKETS];
+} Histogram;
+
+// Filled in as messages are delivered (reset by dtnsim_init / dtnsim_reset)
+typedef struct {
+    Histogram latency_ms; // simulated time from creation until the destination got a copy [ms]
+    Histogram hops;       // hops of the copy the destination got
+} DeliveryHistograms;
+
+// Hardware counters of one step phase, counted on the thread that runs dtnsim_step
+// (user space only)
+typedef struct {
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t llc_misses;    // last-level cache misses
+    uint64_t branch_misses;
+} PhaseCounters;
+
+#define DTNSIM_PERF_CYCLES        1u
+#define DTNSIM_PERF_INSTRUCTIONS  2u
+#define DTNSIM_PERF_LLC_MISSES    4u
+#define DTNSIM_PERF_BRANCH_MISSES 8u
+
+// Wall time and work of the last dtnsim_step, per phase. Only filled in builds with
+// DTNSIM_PROFILE defined; otherwise everything (including `enabled`) stays 0.
+typedef struct {
+    uint32_t enabled;       // 1 when the library was built with DTNSIM_PROFILE
+    uint32_t step;          // step index the numbers belong to
+    double traffic_ms;      // injections and traffic generation
+    double mobility_ms;
+    double grid_ms;         // building the uniform grid
+    double pairs_ms;        // neighbor-cell pair tests
+    double routing_ms;      // anti-packets, contacts and forwarding
+    double expiry_ms;       // TTL wheel
+    double delivery_ms;     // delivery check and message removal
+    double total_ms;
+    uint64_t cells_visited; // non-empty neighbor cells scanned
+    uint64_t pair_tests;    // distance tests
+    uint64_t encounters;    // pairs found in range
+    uint64_t transfers;     // copies sent (RoutingStats::tx growth)
+    uint64_t allocations;   // heap allocations through operator new
+    // Counters read during the step (DTNSIM_PERF_* bits, 0 = none; see
+    // dtnsim_set_perf_counters) and their values per phase, in the order of the *_ms
+    // fields: traffic, mobility, grid, pairs, routing, expiry, delivery
+    uint32_t perf_counters;
+    uint32_t reserved;
+    PhaseCounters phases[7];
+} StepProfile;
+
+// Heap allocations through operator new, for builds with DTNSIM_ALLOC_TRACKING
+// (everything stays 0 otherwise). A step in steady state is expected not to allocate.
+typedef struct {
+    uint32_t enabled;           // 1 when the library was built with DTNSIM_ALLOC_TRACKING
+    uint32_t step;              // step index the step_* fields belong to
+    uint64_t step_allocations;  // allocations during that step (all threads)
+    uint64_t step_bytes;        // bytes they requested
+    uint64_t total_allocations; // since the program started
+    uint64_t total_bytes;
+    uint64_t heap_in_use;       // WASM only: emmalloc heap bytes in use after the step
+} AllocStats;
+
+// Replicas of an "epidemic_ensemble" run (see dtnsim_set_ensemble_sources)
+#define DTNSIM_ENSEMBLE_REPLICAS 64
+typedef struct {
+    uint32_t replicas;    // replicas in the current run (0 = not an ensemble run)
+    uint32_t full_spread; // replicas whose message has reached every agent
+    uint32_t sources[DTNSIM_ENSEMBLE_REPLICAS];          // source agent index of each replica
+    uint32_t reached[DTNSIM_ENSEMBLE_REPLICAS];          // agents holding each replica's message
+    uint32_t full_spread_step[DTNSIM_ENSEMBLE_REPLICAS]; // step it reached every agent (0 = not yet)
+} EnsembleStats;
+
 typedef struct {
     uint32_t src;
     uint32_t dst;
     uint32_t seq;
     uint32_t ttl;
     uint32_t hops;
+    uint32_t size; // bytes; with a link rate set, transfers take size / rate seconds of contact
 } Message;
 
+// One record of a dtnsim_inject_messages batch (5 x uint32)
+typedef struct {
+    uint32_t at_ms; // simulation time of creation [ms]; times already passed mean "now"
+    uint32_t src;   // source agent id (1-based, as in Message)
+    uint32_t dst;   // destination agent id
+    uint32_t ttl;   // seconds (0 = no expiry)
+    uint32_t size;  // bytes (0 = the configured message size)
+} MessageInjection;
+
+// The pointers are 32-bit byte offsets in WASM and full pointers in native builds.
 typedef struct {
-    uint32_t positions_ptr;
-    uint32_t ids_ptr;
+    uintptr_t positions_ptr;
+    uintptr_t ids_ptr;
     uint32_t count;
     uint32_t positions_stride;
     uint32_t version;
     uint32_t reserved;
 } NodePositionsBuffer;
 
+#ifdef __cplusplus
+static_assert(sizeof(NodePositionsBuffer) % 4 == 0, "NodePositionsBuffer must be 4-byte aligned");
+#else
 _Static_assert(sizeof(NodePositionsBuffer) % 4 == 0, "NodePositionsBuffer must be 4-byte aligned");
+#endif
 
 void dtnsim_init(uint32_t agent_count, const char* routing_name);
+// Seed for the following dtnsim_init calls. Seeded runs draw the graph, agents, initial
+// message and mobility from an internal generator restarted at every init, and derive
+// the traffic and drop generators from the seed, so the same seed and settings
+// reproduce a run on every platform. Without a seed the simulator uses rand(), which
+// continues its sequence across inits, as before. Survives dtnsim_reset.
+void dtnsim_set_seed(uint32_t seed);
+// Draw the graph of the following seeded inits from graph_seed while the agents, initial
+// message and mobility still follow the run seed, e.g. for Monte Carlo runs on one
+// graph. dtnsim_set_seed switches back to drawing the graph from the run seed. The
+// graph of seeded runs is read-only and shared by every context that uses the same
+// graph seed, agent count and world size at the same time.
+void dtnsim_set_graph_seed(uint32_t graph_seed);
+// Side length of the cubic world the graph nodes are placed in (default 1500; 0 restores
+// the default). With the fixed communication range it sets the agent density: each
+// agent has about count * 4/3*pi*80^3 / side^3 others in range. Takes effect at the
+// next dtnsim_init and survives dtnsim_reset.
+void dtnsim_set_world_size(double side);
 void dtnsim_step(double dt);
 void dtnsim_reset();
 const RoutingStats* dtnsim_get_stats();
+// Delivery latency and hop-count histograms; the struct stays valid and is updated in
+// place, so JS can keep a BigUint64Array view on it.
+const DeliveryHistograms* dtnsim_get_delivery_histograms();
+// Per-phase profile of the last step (see StepProfile); updated in place.
+const StepProfile* dtnsim_get_profile();
+// Hardware counters for StepProfile (0 = off, the default). Builds with DTNSIM_PROFILE
+// on Linux open cycles, instructions, LLC misses and branch misses with perf_event_open
+// for the calling thread, which must be the one running dtnsim_step (routing threads
+// are not counted). Events the kernel or the CPU does not allow are left out. Returns
+// the DTNSIM_PERF_* bits of the counters that opened; 0 when none did, when turning
+// them off and in other builds.
+uint32_t dtnsim_set_perf_counters(uint32_t enabled);
+// Allocation counts of the last step (see AllocStats); updated in place.
+const AllocStats* dtnsim_get_alloc_stats();
+// Builds with DTNSIM_TRACE record the phases of dtnsim_init / dtnsim_step (and each
+// routing thread's chunks) in a ring of the most recent events. This writes them to
+// `path` as Chrome trace-event JSON (chrome://tracing, Perfetto UI). Call it between
+// steps. Returns the number of events written; 0 without DTNSIM_TRACE or on I/O errors.
+uint32_t dtnsim_write_trace(const char* path);
+// Builds with DTNSIM_REFERENCE can check the step loop against a straightforward
+// reference implementation (0 = off, the default). When on, every dtnsim_init also
+// starts the reference on a copy of the new state, and every dtnsim_step advances it on
+// the same seed and compares encounters, agent positions, buffers (order, hops, arrival
+// step), live messages and RoutingStats. Needs a seeded run and covers carryonly,
+// epidemic and epidemic_bsp without link rate, immunity or the "random" drop policy.
+// Takes effect at the next dtnsim_init and survives dtnsim_reset. Returns 1 if the
+// build has the reference, 0 otherwise.
+uint32_t dtnsim_set_differential(uint32_t enabled);
+// The first divergence found ("step N: ..."; the reference stops there), or why the
+// reference did not start. NULL while the engines agree or differential mode is off.
+const char* dtnsim_get_divergence(void);
 const NodePositionsBuffer* dtnsim_get_node_positions();
 const NodePositionsBuffer* dtnsim_get_agent_positions();
 const Message* dtnsim_get_message_list(uint32_t* out_count);
 // Per-agent delivery state for visualization: one byte per agent (0 = never received initial message, 1 = has received)
 const uint8_t* dtnsim_get_agent_delivered_flags();
+// Per-agent buffer limit (0 = unbounded, the default) and the copy evicted when a full
+// buffer receives a message: "drop-head" (first received, default), "drop-oldest"
+// (earliest created), "drop-youngest" (latest created) or "random". MaxProp always
+// evicts its lowest-priority copy. Takes effect immediately and survives dtnsim_reset.
+void dtnsim_set_buffer_policy(uint32_t capacity, const char* policy_name);
+// TTL in simulation seconds for messages created from now on, including the initial
+// message of dtnsim_init (0 = no expiry, the default). An expired message is removed
+// with all of its copies. Survives dtnsim_reset.
+void dtnsim_set_message_ttl(uint32_t ttl_seconds);
+// Contact bandwidth in bytes per second for each direction of an encounter (0 = unlimited,
+// the default). Each step an encounter moves at most rate * dt bytes per direction; a
+// message that does not fit continues on later steps while the pair stays in range and
+// is abandoned when the contact breaks. Survives dtnsim_reset.
+void dtnsim_set_link_rate(double bytes_per_second);
+// Size in bytes of messages created from now on (default 1024). Survives dtnsim_reset.
+void dtnsim_set_message_size(uint32_t bytes);
+// Summary-vector mode (0 = off, the default): each agent keeps a counting Bloom filter
+// of the messages it holds, and encounters consult the peer's filter before the exact
+// buffer lookup, which is then only needed for messages the filter reports as maybe
+// held. Results are identical either way. Survives dtnsim_reset.
+void dtnsim_set_summary_vectors(uint32_t enabled);
+// Immunity mode (0 = off, the default). Off, a delivered message disappears with all
+// of its copies at once. On, only the destination's copy goes; the destination keeps
+// an anti-packet (the message id) that spreads one hop per step to the agents it
+// meets, which drop their copies and refuse the message from then on. Works with
+// every routing mode. Survives dtnsim_reset.
+void dtnsim_set_immunity(uint32_t enabled);
+// Routing threads (default 1). Each step's encounters are split into rounds in which
+// no agent appears twice, and large rounds are spread over the threads. Results do
+// not depend on the thread count. Builds without DTNSIM_THREADS (such as the default
+// WASM build) accept the setting but always route on the calling thread. Survives
+// dtnsim_reset.
+void dtnsim_set_threads(uint32_t count);
+// Poisson traffic: every agent creates rate_per_agent messages per simulation second
+// on average, with the configured TTL and size. A share hotspot_fraction of them is
+// addressed to one of hotspot_count agents drawn at random, the rest to a uniformly
+// chosen agent. rate 0 (the default) turns the generator off. Survives dtnsim_reset.
+void dtnsim_set_traffic(double rate_per_agent, uint32_t hotspot_count, double hotspot_fraction);
+// Batch/trace injection: `packed` holds `count` MessageInjection records. Records
+// whose time has passed are created immediately, the others at the first step that
+// reaches their time. Records with invalid agents or src == dst are skipped. Returns
+// the number of records accepted. Pending records are discarded by dtnsim_reset.
+uint32_t dtnsim_inject_messages(const uint32_t* packed, uint32_t count);
+// Routing "epidemic_ensemble" runs up to DTNSIM_ENSEMBLE_REPLICAS epidemic spreads of
+// one message from different sources in lockstep on the same mobility: replica r is
+// bit r of a 64-bit mask per agent, and an encounter passes every replica at once.
+// Like Epidemic a copy moves one hop per step; replicas have no destination, so each
+// spreads until every agent holds it. Replica 0 starts at the source of the initial
+// message the other modes would create (same seed, same mobility), and RoutingStats
+// and the delivered flags follow replica 0. Traffic and injected messages are not
+// routed in this mode.
+// Source agents (0-based) of the replicas of the next ensemble inits; count 0 (the
+// default) runs min(64, agents) replicas from the initial source and agents evenly
+// spaced after it. Sources beyond the agent count are skipped at init. Returns the
+// number of sources kept. Survives dtnsim_reset.
+uint32_t dtnsim_set_ensemble_sources(const uint32_t* agent_indices, uint32_t count);
+// Per-replica progress of the current ensemble run; updated in place
+const EnsembleStats* dtnsim_get_ensemble_stats(void);
+// Replica masks, one per agent (bit r = holds replica r's message); NULL outside
+// ensemble runs
+const uint64_t* dtnsim_get_ensemble_state(void);
+
+
+// Simulation contexts. Every call above works on one process-wide simulation; the
+// dtnsim_ctx_* variants below do the same on a context made by dtnsim_create, so a
+// process can run any number of independent simulations, concurrently from several
+// threads as long as each context is used by one thread at a time (its routing
+// threads are its own). dtnsim_write_trace stays process-wide, and so do the
+// allocation counts behind AllocStats. Unseeded runs share the C library's rand().
+typedef struct DtnSim DtnSim;
+// A new context with the default settings (nothing survives from other contexts)
+DtnSim* dtnsim_create(void);
+// Free a context and everything it returned; NULL is ignored
+void dtnsim_destroy(DtnSim* sim);
+// The context behind the dtnsim_* calls without one
+DtnSim* dtnsim_default_context(void);
+// Shared mobility for routing comparisons: after dtnsim_ctx_follow(follower, leader),
+// stepping the leader also steps the follower, which takes the leader's agent movement
+// and routes its own messages over the leader's encounter list, so several routing
+// modes or settings run on one mobility and encounter detection pass. Stepping a
+// follower by itself does nothing. Initialize both with the same seed, agent count and
+// world size (the initial message and traffic then match too) before attaching: a
+// follower whose agent count differs from the leader's is refused. A leader cannot
+// follow and a follower cannot lead; leader NULL detaches. Leader and followers must
+// be used from one thread at a time. Returns 1 if attached or detached, 0 if refused.
+// Survives dtnsim_reset (a follower or leader that is reset does not step until it is
+// initialized again) and dtnsim_init, except that an init leaving a follower and its
+// leader with different agent counts detaches it; dtnsim_destroy detaches.
+uint32_t dtnsim_ctx_follow(DtnSim* follower, DtnSim* leader);
+void dtnsim_ctx_init(DtnSim* sim, uint32_t agent_count, const char* routing_name);
+void dtnsim_ctx_set_seed(DtnSim* sim, uint32_t seed);
+void dtnsim_ctx_set_graph_seed(DtnSim* sim, uint32_t graph_seed);
+void dtnsim_ctx_set_world_size(DtnSim* sim, double side);
+void dtnsim_ctx_step(DtnSim* sim, double dt);
+void dtnsim_ctx_reset(DtnSim* sim);
+const RoutingStats* dtnsim_ctx_get_stats(DtnSim* sim);
+const DeliveryHistograms* dtnsim_ctx_get_delivery_histograms(DtnSim* sim);
+const StepProfile* dtnsim_ctx_get_profile(DtnSim* sim);
+uint32_t dtnsim_ctx_set_perf_counters(DtnSim* sim, uint32_t enabled);
+const AllocStats* dtnsim_ctx_get_alloc_stats(DtnSim* sim);
+uint32_t dtnsim_ctx_set_differential(DtnSim* sim, uint32_t enabled);
+const char* dtnsim_ctx_get_divergence(DtnSim* sim);
+const NodePositionsBuffer* dtnsim_ctx_get_node_positions(DtnSim* sim);
+const NodePositionsBuffer* dtnsim_ctx_get_agent_positions(DtnSim* sim);
+const Message* dtnsim_ctx_get_message_list(DtnSim* sim, uint32_t* out_count);
+const uint8_t* dtnsim_ctx_get_agent_delivered_flags(DtnSim* sim);
+void dtnsim_ctx_set_buffer_policy(DtnSim* sim, uint32_t capacity, const char* policy_name);
+void dtnsim_ctx_set_message_ttl(DtnSim* sim, uint32_t ttl_seconds);
+void dtnsim_ctx_set_link_rate(DtnSim* sim, double bytes_per_second);
+void dtnsim_ctx_set_message_size(DtnSim* sim, uint32_t bytes);
+void dtnsim_ctx_set_summary_vectors(DtnSim* sim, uint32_t enabled);
+void dtnsim_ctx_set_immunity(DtnSim* sim, uint32_t enabled);
+void dtnsim_ctx_set_threads(DtnSim* sim, uint32_t count);
+void dtnsim_ctx_set_traffic(DtnSim* sim, double rate_per_agent, uint32_t hotspot_count, double hotspot_fraction);
+uint32_t dtnsim_ctx_inject_messages(DtnSim* sim, const uint32_t* packed, uint32_t count);
+uint32_t dtnsim_ctx_set_ensemble_sources(DtnSim* sim, const uint32_t* agent_indices, uint32_t count);
+const EnsembleStats* dtnsim_ctx_get_ensemble_stats(DtnSim* sim);
+const uint64_t* dtnsim_ctx_get_ensemble_state(DtnSim* sim);
 
 #ifdef __cplusplus
 }
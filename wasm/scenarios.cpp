@@ -0,0 +1,275 @@
+// dtnsim-scenarios: end-to-end benchmark of fixed-seed scenarios. Every scenario runs
+// to completion through the C ABI, reports its wall time and spread time, and its
+// final RoutingStats are compared with the golden values checked in next to this file
+// (scenarios.golden), so optimizations cannot change simulation results unnoticed.
+// Scenarios with an allocation warm-up also fail if a later step allocates.
+
+#include "dtnsim_api.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef DTNSIM_SCENARIO_GOLDEN
+#define DTNSIM_SCENARIO_GOLDEN "scenarios.golden"
+#endif
+
+namespace {
+
+struct Scenario {
+    const char* name;
+    uint32_t agents;
+    double world_size;   // side of the world box (sets the density)
+    const char* routing;
+    double traffic;      // Poisson messages per agent per second (0 = initial message only)
+    uint32_t buffer;     // per-agent buffer capacity (0 = unbounded)
+    uint32_t ttl;        // message TTL [s] (0 = no expiry)
+    uint32_t max_steps;  // traffic and ensemble scenarios always run this long
+    uint32_t alloc_warmup; // steps after which no step may allocate (0 = not checked)
+};
+
+// 500 agents: sparse has about 0.26 agents in range of an agent, dense about 4. Steps
+// with a single message must not allocate once the first has run; under traffic the
+// message table and holder lists still grow with the number of live messages
+const Scenario SCENARIOS[] = {
+    { "sparse_carryonly_single",    500, 1600.0, "carryonly",         0.0,   0,  0, 20000, 1 },
+    { "sparse_epidemic_single",     500, 1600.0, "epidemic",          0.0,   0,  0, 20000, 1 },
+    { "dense_carryonly_single",     500,  640.0, "carryonly",         0.0,   0,  0, 20000, 1 },
+    { "dense_epidemic_single",      500,  640.0, "epidemic",          0.0,   0,  0, 20000, 1 },
+    { "sparse_carryonly_traffic",   500, 1600.0, "carryonly",         0.02, 20, 60,  4000, 0 },
+    { "sparse_epidemic_traffic",    500, 1600.0, "epidemic",          0.02, 20, 60,  4000, 0 },
+    { "dense_carryonly_traffic",    500,  640.0, "carryonly",         0.02, 20, 60,  4000, 0 },
+    { "dense_epidemic_traffic",     500,  640.0, "epidemic",          0.02, 20, 60,  4000, 0 },
+    { "sparse_prophet_single",      500, 1600.0, "prophet",           0.0,   0,  0, 20000, 1 },
+    { "sparse_maxprop_single",      500, 1600.0, "maxprop",           0.0,   0,  0, 20000, 1 },
+    { "sparse_epidemic_bsp_single", 500, 1600.0, "epidemic_bsp",      0.0,   0,  0, 20000, 1 },
+    { "dense_prophet_single",       500,  640.0, "prophet",           0.0,   0,  0, 20000, 1 },
+    { "dense_maxprop_single",       500,  640.0, "maxprop",           0.0,   0,  0, 20000, 1 },
+    { "dense_epidemic_bsp_single",  500,  640.0, "epidemic_bsp",      0.0,   0,  0, 20000, 1 },
+    { "sparse_ensemble_single",     500, 1600.0, "epidemic_ensemble", 0.0,   0,  0,  4000, 1 },
+    { "dense_ensemble_single",      500,  640.0, "epidemic_ensemble", 0.0,   0,  0,  4000, 1 },
+};
+constexpr double SCENARIO_DT = 0.05;
+constexpr uint32_t SCENARIO_SEED = 20240601;
+
+struct Options {
+    const char* golden = DTNSIM_SCENARIO_GOLDEN;
+    const char* only = nullptr;
+    uint32_t threads = 1;
+    bool update = false;
+};
+
+void usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --golden PATH   golden results (default %s)\n"
+        "  --only NAME     run a single scenario\n"
+        "  --threads N     routing threads (results must not change)\n"
+        "  --update        rewrite the golden file from this run instead of checking\n",
+        argv0, DTNSIM_SCENARIO_GOLDEN);
+}
+
+bool parse(int argc, char** argv, Options& o) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (std::strcmp(arg, "--update") == 0) {
+            o.update = true;
+            continue;
+        }
+        const char* val = (i + 1 < argc) ? argv[++i] : nullptr;
+        if (!val) {
+            std::fprintf(stderr, "%s needs a value\n", arg);
+            return false;
+        }
+        if (std::strcmp(arg, "--golden") == 0) {
+            o.golden = val;
+        } else if (std::strcmp(arg, "--only") == 0) {
+            o.only = val;
+        } else if (std::strcmp(arg, "--threads") == 0) {
+            o.threads = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", arg);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Run one scenario to completion: single-message scenarios stop once no message is
+// left (the initial message is removed at its destination, so it does not reach every
+// agent), ensemble and traffic scenarios run for max_steps. Returns the result line compared with the
+// golden file; alloc_step is the first step after the warm-up that allocated (-1 =
+// none or not checked).
+std::string run(const Scenario& sc, double& wall_s, uint32_t& steps, int64_t& alloc_step) {
+    dtnsim_set_seed(SCENARIO_SEED);
+    dtnsim_set_world_size(sc.world_size);
+    dtnsim_set_buffer_policy(sc.buffer, "drop-head");
+    dtnsim_set_message_ttl(sc.ttl);
+    dtnsim_set_traffic(sc.traffic, 0, 0.0);
+    dtnsim_init(sc.agents, sc.routing);
+    const RoutingStats* st = dtnsim_get_stats();
+    const AllocStats* as = dtnsim_get_alloc_stats();
+    const EnsembleStats* es = dtnsim_get_ensemble_stats();
+
+    const auto t0 = std::chrono::steady_clock::now();
+    int64_t spread_step = 0;         // last step in which an agent first got the initial message
+    int64_t replica_spread_step = 0; // ensembles: last step in which any replica reached an agent
+    uint64_t replica_reached = 0;
+    uint64_t reached = st->delivered;
+    alloc_step = -1;
+    for (steps = 0; steps < sc.max_steps;) {
+        dtnsim_step(SCENARIO_DT);
+        steps++;
+        if (sc.alloc_warmup > 0 && steps > sc.alloc_warmup && alloc_step < 0 && as->step_allocations > 0) {
+            alloc_step = steps;
+        }
+        if (st->delivered != reached) {
+            reached = st->delivered;
+            spread_step = steps;
+        }
+        if (es->replicas > 0) {
+            uint64_t total = 0;
+            for (uint32_t r = 0; r < es->replicas; ++r) total += es->reached[r];
+            if (total != replica_reached) {
+                replica_reached = total;
+                replica_spread_step = steps;
+            }
+        } else if (sc.traffic == 0.0) {
+            uint32_t live = 0;
+            dtnsim_get_message_list(&live);
+            if (live == 0) break;
+        }
+    }
+    wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    std::ostringstream line;
+    line << "steps=" << steps << " spread_step=" << spread_step << " delivered=" << st->delivered << " tx=" << st->tx << " rx=" << st->rx
+         << " duplicates=" << st->duplicates << " duplicate_offers=" << st->duplicate_offers
+         << " dropped=" << st->dropped << " expired=" << st->expired << " created=" << st->created
+         << " immunized=" << st->immunized;
+    if (es->replicas > 0) {
+        // Spread of all replicas; agents that never meet anyone stay out of reach
+        uint32_t reached_min = sc.agents;
+        for (uint32_t r = 0; r < es->replicas; ++r) reached_min = std::min(reached_min, es->reached[r]);
+        line << " replicas=" << es->replicas << " replica_reached_min=" << reached_min
+             << " replica_spread_step=" << replica_spread_step;
+    }
+    return line.str();
+}
+
+// Golden file: "<scenario> <result line>" per line, '#' starts a comment
+std::map<std::string, std::string> read_golden(const char* path, bool& ok) {
+    std::map<std::string, std::string> golden;
+    std::ifstream in(path);
+    ok = static_cast<bool>(in);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        const size_t sp = line.find(' ');
+        if (sp == std::string::npos) continue;
+        golden[line.substr(0, sp)] = line.substr(sp + 1);
+    }
+    return golden;
+}
+
+// Print the key=value pairs that differ between two result lines
+void print_diff(const std::string& expected, const std::string& got) {
+    std::istringstream e(expected), g(got);
+    std::string ev, gv;
+    while (e >> ev && g >> gv) {
+        if (ev != gv) std::printf("    expected %s, got %s\n", ev.c_str(), gv.c_str());
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    Options o;
+    if (!parse(argc, argv, o)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (o.update && o.only) {
+        std::fprintf(stderr, "--update rewrites the whole file; run it without --only\n");
+        return 2;
+    }
+    bool have_golden = false;
+    const std::map<std::string, std::string> golden = read_golden(o.golden, have_golden);
+    if (!have_golden && !o.update) {
+        std::fprintf(stderr, "cannot read %s (use --update to create it)\n", o.golden);
+        return 2;
+    }
+    dtnsim_set_threads(o.threads);
+
+    std::ostringstream updated;
+    updated << "# dtnsim-scenarios golden results (dt " << SCENARIO_DT << ", seed " << SCENARIO_SEED
+            << "); regenerate with dtnsim-scenarios --update\n";
+    uint32_t ran = 0, failed = 0;
+    for (const Scenario& sc : SCENARIOS) {
+        if (o.only && std::strcmp(o.only, sc.name) != 0) continue;
+        double wall_s = 0.0;
+        uint32_t steps = 0;
+        int64_t alloc_step = -1;
+        const std::string result = run(sc, wall_s, steps, alloc_step);
+        ran++;
+        updated << sc.name << ' ' << result << '\n';
+
+        const char* verdict = "";
+        const auto it = golden.find(sc.name);
+        if (!o.update) {
+            if (it == golden.end()) {
+                verdict = "NO GOLDEN";
+                failed++;
+            } else if (it->second != result) {
+                verdict = "MISMATCH";
+                failed++;
+            } else if (alloc_step >= 0) {
+                verdict = "ALLOCATES";
+                failed++;
+            } else {
+                verdict = "ok";
+            }
+        }
+        std::printf("%-26s wall_s=%.3f steps_per_s=%.1f sim_s=%.2f %s\n", sc.name, wall_s,
+                    wall_s > 0.0 ? steps / wall_s : 0.0, steps * SCENARIO_DT, verdict);
+        std::printf("    %s\n", result.c_str());
+        if (!o.update && it != golden.end() && it->second != result) print_diff(it->second, result);
+        if (!o.update && alloc_step >= 0) {
+            std::printf("    step %lld allocated after a warm-up of %u steps\n",
+                        static_cast<long long>(alloc_step), sc.alloc_warmup);
+        }
+    }
+    if (ran == 0) {
+        std::fprintf(stderr, "no scenario named %s\n", o.only);
+        return 2;
+    }
+
+    if (o.update) {
+        std::ofstream out(o.golden);
+        out << updated.str();
+        if (!out) {
+            std::fprintf(stderr, "cannot write %s\n", o.golden);
+            return 2;
+        }
+        std::printf("wrote %s\n", o.golden);
+        return 0;
+    }
+    if (failed > 0) {
+        std::printf("%u of %u scenarios failed against %s\n", failed, ran, o.golden);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,330 @@
+// dtnsim-sweep: parallel parameter sweeps and Monte Carlo ensembles. Runs the cross
+// product of seeds x agent counts x world sizes x routing modes on a pool of threads,
+// each stepping its own DtnSim context, and streams one result row per finished run as
+// CSV or JSON Lines. Runs on the same graph (same graph seed, agent count and world
+// size) share one read-only copy of it in the library.
+
+#include "dtnsim_api.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Options {
+    std::vector<uint32_t> seeds = { 1 };
+    std::vector<uint32_t> agents = { 100 };
+    std::vector<double> world_sizes = { 1500.0 };
+    std::vector<std::string> routings = { "epidemic" };
+    bool fixed_graph = false; // every run on the graph of graph_seed
+    uint32_t graph_seed = 0;
+    double dt = 0.05;
+    uint32_t max_steps = 20000;
+    double traffic = 0.0;
+    uint32_t buffer = 0;
+    std::string policy = "drop-head";
+    uint32_t ttl = 0;
+    bool full_spread = false; // stop a run once every agent has the initial message
+    uint32_t jobs = 0;        // 0 = hardware threads
+    bool json = false;
+    const char* out_path = nullptr;
+};
+
+void usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --seeds LIST        run seeds, e.g. 1-100 or 1,5,9 (default 1)\n"
+        "  --agents LIST       agent counts (default 100)\n"
+        "  --world LIST        world sizes, i.e. densities (default 1500)\n"
+        "  --routing LIST      carryonly, epidemic, prophet, maxprop, epidemic_bsp (default epidemic)\n"
+        "  --graph-seed N      run every seed on the graph of seed N (default: each seed's own)\n"
+        "  --dt S              simulation seconds per step (default 0.05)\n"
+        "  --max-steps N       steps per run at most (default 20000)\n"
+        "  --traffic RATE      Poisson messages per agent per second (default 0)\n"
+        "  --buffer N          per-agent buffer capacity (default 0 = unbounded)\n"
+        "  --policy NAME       drop policy of full buffers (default drop-head)\n"
+        "  --ttl S             message TTL in seconds (default 0 = no expiry)\n"
+        "  --full-spread       stop a run once the initial message has reached every agent\n"
+        "  --jobs N            runs in parallel (default: hardware threads)\n"
+        "  --format FMT        csv or json (JSON Lines; default csv)\n"
+        "  --out PATH          write the results to PATH instead of stdout\n"
+        "Without traffic a run also stops when no message is left.\n",
+        argv0);
+}
+
+// Comma-separated values; integer lists also take ranges "a-b"
+bool parse_uint_list(const char* s, std::vector<uint32_t>& out) {
+    out.clear();
+    while (*s) {
+        char* end = nullptr;
+        const unsigned long lo = std::strtoul(s, &end, 10);
+        if (end == s) return false;
+        unsigned long hi = lo;
+        if (*end == '-') {
+            s = end + 1;
+            hi = std::strtoul(s, &end, 10);
+            if (end == s || hi < lo) return false;
+        }
+        for (unsigned long v = lo; v <= hi; ++v) out.push_back(static_cast<uint32_t>(v));
+        if (*end == ',') ++end;
+        else if (*end) return false;
+        s = end;
+    }
+    return !out.empty();
+}
+
+bool parse_double_list(const char* s, std::vector<double>& out) {
+    out.clear();
+    while (*s) {
+        char* end = nullptr;
+        const double v = std::strtod(s, &end);
+        if (end == s) return false;
+        out.push_back(v);
+        if (*end == ',') ++end;
+        else if (*end) return false;
+        s = end;
+    }
+    return !out.empty();
+}
+
+std::vector<std::string> split(const char* s) {
+    std::vector<std::string> out;
+    std::string cur;
+    for (; *s; ++s) {
+        if (*s == ',') {
+            out.push_back(cur);
+            cur.clear();
+        } else {
+            cur += *s;
+        }
+    }
+    out.push_back(cur);
+    return out;
+}
+
+bool parse(int argc, char** argv, Options& o) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        auto need = [&]() {
+            if (!val) {
+                std::fprintf(stderr, "%s needs a value\n", arg);
+                return false;
+            }
+            ++i;
+            return true;
+        };
+        auto bad = [&]() {
+            std::fprintf(stderr, "bad value for %s: %s\n", arg, val);
+            return false;
+        };
+        if (std::strcmp(arg, "--seeds") == 0) {
+            if (!need()) return false;
+            if (!parse_uint_list(val, o.seeds)) return bad();
+        } else if (std::strcmp(arg, "--agents") == 0) {
+            if (!need()) return false;
+            if (!parse_uint_list(val, o.agents)) return bad();
+        } else if (std::strcmp(arg, "--world") == 0) {
+            if (!need()) return false;
+            if (!parse_double_list(val, o.world_sizes)) return bad();
+        } else if (std::strcmp(arg, "--routing") == 0) {
+            if (!need()) return false;
+            o.routings = split(val);
+        } else if (std::strcmp(arg, "--graph-seed") == 0) {
+            if (!need()) return false;
+            o.fixed_graph = true;
+            o.graph_seed = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--dt") == 0) {
+            if (!need()) return false;
+            o.dt = std::strtod(val, nullptr);
+        } else if (std::strcmp(arg, "--max-steps") == 0) {
+            if (!need()) return false;
+            o.max_steps = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--traffic") == 0) {
+            if (!need()) return false;
+            o.traffic = std::strtod(val, nullptr);
+        } else if (std::strcmp(arg, "--buffer") == 0) {
+            if (!need()) return false;
+            o.buffer = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--policy") == 0) {
+            if (!need()) return false;
+            o.policy = val;
+        } else if (std::strcmp(arg, "--ttl") == 0) {
+            if (!need()) return false;
+            o.ttl = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--full-spread") == 0) {
+            o.full_spread = true;
+        } else if (std::strcmp(arg, "--jobs") == 0) {
+            if (!need()) return false;
+            o.jobs = static_cast<uint32_t>(std::strtoul(val, nullptr, 10));
+        } else if (std::strcmp(arg, "--format") == 0) {
+            if (!need()) return false;
+            if (std::strcmp(val, "csv") == 0) o.json = false;
+            else if (std::strcmp(val, "json") == 0) o.json = true;
+            else return bad();
+        } else if (std::strcmp(arg, "--out") == 0) {
+            if (!need()) return false;
+            o.out_path = val;
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", arg);
+            return false;
+        }
+    }
+    if (o.dt <= 0.0) {
+        std::fprintf(stderr, "--dt must be positive\n");
+        return false;
+    }
+    return true;
+}
+
+struct Run {
+    uint32_t index;
+    uint32_t seed;
+    uint32_t agents;
+    double world_size;
+    const std::string* routing;
+};
+
+// Runs on one graph are adjacent, so workers pick them up close together and the
+// library hands out the graph it already has
+std::vector<Run> plan(const Options& o) {
+    std::vector<Run> runs;
+    for (uint32_t agents : o.agents) {
+        for (double world : o.world_sizes) {
+            for (uint32_t seed : o.seeds) {
+                for (const std::string& routing : o.routings) {
+                    runs.push_back(Run{ static_cast<uint32_t>(runs.size()), seed, agents, world, &routing });
+                }
+            }
+        }
+    }
+    return runs;
+}
+
+struct Result {
+    uint32_t steps = 0;
+    int64_t full_spread_step = -1; // step at which every agent had the initial message (-1 = never)
+    double wall_s = 0.0;
+    RoutingStats stats{};
+};
+
+Result simulate(DtnSim* sim, const Options& o, const Run& r) {
+    dtnsim_ctx_set_seed(sim, r.seed);
+    if (o.fixed_graph) dtnsim_ctx_set_graph_seed(sim, o.graph_seed);
+    dtnsim_ctx_set_world_size(sim, r.world_size);
+    dtnsim_ctx_set_buffer_policy(sim, o.buffer, o.policy.c_str());
+    dtnsim_ctx_set_message_ttl(sim, o.ttl);
+    dtnsim_ctx_set_traffic(sim, o.traffic, 0, 0.0);
+    dtnsim_ctx_init(sim, r.agents, r.routing->c_str());
+    const RoutingStats* st = dtnsim_ctx_get_stats(sim);
+
+    Result res;
+    const auto t0 = std::chrono::steady_clock::now();
+    while (res.steps < o.max_steps) {
+        dtnsim_ctx_step(sim, o.dt);
+        res.steps++;
+        if (res.full_spread_step < 0 && st->delivered >= r.agents) {
+            res.full_spread_step = res.steps;
+            if (o.full_spread) break;
+        }
+        if (o.traffic == 0.0) {
+            uint32_t live = 0;
+            dtnsim_ctx_get_message_list(sim, &live);
+            if (live == 0) break;
+        }
+    }
+    res.wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    res.stats = *st;
+    return res;
+}
+
+const char* const CSV_HEADER =
+    "run,routing,agents,world_size,seed,graph_seed,steps,sim_s,full_spread_s,wall_s,"
+    "delivered,tx,rx,duplicates,duplicate_offers,dropped,expired,created,immunized\n";
+
+std::string format_row(const Options& o, const Run& r, const Result& res) {
+    const RoutingStats& st = res.stats;
+    const uint32_t graph_seed = o.fixed_graph ? o.graph_seed : r.seed;
+    const double sim_s = res.steps * o.dt;
+    const double spread_s = res.full_spread_step >= 0 ? res.full_spread_step * o.dt : -1.0;
+    char buf[768];
+    const char* fmt = o.json
+        ? "{\"run\":%u,\"routing\":\"%s\",\"agents\":%u,\"world_size\":%g,\"seed\":%u,\"graph_seed\":%u,"
+          "\"steps\":%u,\"sim_s\":%.3f,\"full_spread_s\":%.3f,\"wall_s\":%.6f,\"delivered\":%llu,"
+          "\"tx\":%llu,\"rx\":%llu,\"duplicates\":%llu,\"duplicate_offers\":%llu,\"dropped\":%llu,"
+          "\"expired\":%llu,\"created\":%llu,\"immunized\":%llu}\n"
+        : "%u,%s,%u,%g,%u,%u,%u,%.3f,%.3f,%.6f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n";
+    std::snprintf(buf, sizeof(buf), fmt, r.index, r.routing->c_str(), r.agents, r.world_size, r.seed,
+                  graph_seed, res.steps, sim_s, spread_s, res.wall_s,
+                  static_cast<unsigned long long>(st.delivered), static_cast<unsigned long long>(st.tx),
+                  static_cast<unsigned long long>(st.rx), static_cast<unsigned long long>(st.duplicates),
+                  static_cast<unsigned long long>(st.duplicate_offers),
+                  static_cast<unsigned long long>(st.dropped), static_cast<unsigned long long>(st.expired),
+                  static_cast<unsigned long long>(st.created), static_cast<unsigned long long>(st.immunized));
+    return buf;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    Options o;
+    if (!parse(argc, argv, o)) {
+        usage(argv[0]);
+        return 2;
+    }
+    FILE* out = stdout;
+    if (o.out_path) {
+        out = std::fopen(o.out_path, "w");
+        if (!out) {
+            std::fprintf(stderr, "cannot write %s\n", o.out_path);
+            return 2;
+        }
+    }
+    const std::vector<Run> runs = plan(o);
+    uint32_t jobs = o.jobs ? o.jobs : std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::min<uint32_t>(jobs, static_cast<uint32_t>(runs.size()));
+    if (!o.json) std::fputs(CSV_HEADER, out);
+
+    // Each worker keeps one context for all its runs, so their storage is reused; rows
+    // are written in the order runs finish (the run column gives the plan order)
+    std::atomic<size_t> next{ 0 };
+    std::mutex out_mutex;
+    const auto t0 = std::chrono::steady_clock::now();
+    auto worker = [&]() {
+        DtnSim* sim = dtnsim_create();
+        for (size_t i = next++; i < runs.size(); i = next++) {
+            const std::string row = format_row(o, runs[i], simulate(sim, o, runs[i]));
+            std::lock_guard<std::mutex> lock(out_mutex);
+            std::fputs(row.c_str(), out);
+            std::fflush(out);
+        }
+        dtnsim_destroy(sim);
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t t = 1; t < jobs; ++t) threads.emplace_back(worker);
+    worker();
+    for (std::thread& t : threads) t.join();
+    const double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    if (out != stdout && std::fclose(out) != 0) {
+        std::fprintf(stderr, "cannot write %s\n", o.out_path);
+        return 2;
+    }
+    std::fprintf(stderr, "runs=%zu jobs=%u wall_s=%.3f runs_per_s=%.2f\n", runs.size(), jobs, wall_s,
+                 wall_s > 0.0 ? runs.size() / wall_s : 0.0);
+    return 0;
+}